@@ -1,34 +1,228 @@
+#include "include/KaleidoscopeJIT.h"
 #include "include/argparse.hpp"
 #include "include/codegen.h"
 #include "include/kpp.h"
 #include "include/lexer.h"
+#include "include/objcache.h"
 #include "include/parser.h"
+#include "include/runtime.h"
 #include "llvm-c/Core.h"
 #include "llvm-c/TargetMachine.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/CodeGen.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
 
+#ifdef KALEIDOSCOPE_HAVE_LLD
+#include "lld/Common/Driver.h"
+#include "linkargs.h"
+
+LLD_HAS_DRIVER(elf)
+#endif
+
 using namespace llvm;
 using namespace llvm::sys;
 
+struct ModuleSize {
+  unsigned Functions = 0;
+  unsigned Instructions = 0;
+};
+
+// count the defined functions and their instructions
+static ModuleSize getModuleSize(const Module &M) {
+  ModuleSize Size;
+  for (const Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    Size.Functions++;
+    Size.Instructions += F.getInstructionCount();
+  }
+  return Size;
+}
+
+// find a runtime file next to the compiler, or in ../lib when installed
+static std::string findRuntimeFile(const char *Argv0, StringRef Name) {
+  std::string Exe =
+      sys::fs::getMainExecutable(Argv0, (void *)&findRuntimeFile);
+  StringRef ExeDir = sys::path::parent_path(Exe);
+  for (const char *Dir : {"", "../lib"}) {
+    SmallString<128> Path(ExeDir);
+    sys::path::append(Path, Dir, Name);
+    if (sys::fs::exists(Path))
+      return std::string(Path);
+  }
+  return "";
+}
+
+// link the objects into an executable, in-process through lld when the
+// compiler was built with it and by running clang++ otherwise
+static bool linkExecutable(const std::vector<std::string> &Objects,
+                           const std::string &Output) {
+#ifdef KALEIDOSCOPE_HAVE_LLD
+  std::vector<const char *> Args{"ld.lld"};
+  for (const char *Arg : LinkerArgs) {
+    if (StringRef(Arg) == "{objects}") {
+      for (auto &Object : Objects)
+        Args.push_back(Object.c_str());
+    } else if (StringRef(Arg) == "{output}") {
+      Args.push_back(Output.c_str());
+    } else {
+      Args.push_back(Arg);
+    }
+  }
+  lld::Result Result =
+      lld::lldMain(Args, outs(), errs(), {{lld::Gnu, &lld::elf::link}});
+  if (Result.retCode != 0) {
+    errs() << "Linking failed with exit code " << Result.retCode << '\n';
+    return false;
+  }
+  return true;
+#else
+  auto Clang = sys::findProgramByName("clang++");
+  if (!Clang) {
+    errs() << "Could not find clang++ to link with\n";
+    return false;
+  }
+  std::vector<StringRef> Args{*Clang};
+  for (auto &Object : Objects)
+    Args.push_back(Object);
+  Args.push_back("-o");
+  Args.push_back(Output);
+  int RetCode = sys::ExecuteAndWait(*Clang, Args);
+  if (RetCode != 0) {
+    errs() << "Linking failed with exit code " << RetCode << '\n';
+    return false;
+  }
+  return true;
+#endif
+}
+
+// how --run and --repl set up the JIT
+struct JITOptions {
+  bool Lazy = false;
+  unsigned Threads = 1;
+  bool UseJITLink = false;
+  ObjectFileCache *Cache = nullptr;
+  unsigned TierUpThreshold = 0;
+  bool PrintTierStats = false;
+  bool PerfMap = false;
+  bool JITDump = false;
+};
+
+// a JIT for running programs in-process. The runtime is linked into the
+// compiler, so its functions are defined as absolute symbols instead of being
+// searched for in the process.
+static std::unique_ptr<orc::KaleidoscopeJIT>
+createJIT(const JITOptions &Options) {
+  auto JIT = ExitOnErr(orc::KaleidoscopeJIT::Create(
+      Options.Lazy, Options.Threads, Options.UseJITLink, Options.Cache,
+      Options.TierUpThreshold));
+  if (Options.PerfMap || Options.JITDump)
+    ExitOnErr(JIT->enableProfiling(Options.PerfMap, Options.JITDump));
+  std::pair<const char *, void *> Runtime[] = {
+      {"putchard", (void *)&putchard},
+      {"printd", (void *)&printd},
+      {"flushd", (void *)&flushd},
+      {"clockd", (void *)&clockd},
+      {"rdtscd", (void *)&rdtscd},
+      {"kdbench", (void *)&kdbench},
+      {"kdarray_new", (void *)&kdarray_new},
+      {"kdarray_oob", (void *)&kdarray_oob},
+      {"kdarray_map", (void *)&kdarray_map},
+  };
+  for (auto &Symbol : Runtime)
+    ExitOnErr(JIT->defineAbsolute(Symbol.first,
+                                  orc::ExecutorAddr::fromPtr(Symbol.second)));
+  return JIT;
+}
+
+// compile the module in memory and call its main, with --stats reporting how
+// much of it had to be compiled and how long it took from the start of the
+// compiler until main returned
+static int runModule(const JITOptions &Options, bool PrintStats,
+                     std::chrono::steady_clock::time_point StartTime) {
+  auto JIT = createJIT(Options);
+  ObjectFileCache *Cache = Options.Cache;
+  unsigned Jobs = Options.Threads;
+  if (Jobs == 1) {
+    ExitOnErr(JIT->addModule(
+        orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+  } else {
+    // modules sharing a context are compiled one at a time, so each part is
+    // moved into a context of its own through bitcode
+    SplitModule(*TheModule, Jobs, [&](std::unique_ptr<Module> Part) {
+      SmallString<0> Bitcode;
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(*Part, OS);
+      auto Context = std::make_unique<LLVMContext>();
+      auto M = ExitOnErr(parseBitcodeFile(
+          MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), "part"),
+          *Context));
+      ExitOnErr(JIT->addModule(
+          orc::ThreadSafeModule(std::move(M), std::move(Context))));
+    });
+  }
+  auto Main = JIT->lookup("main");
+  if (!Main) {
+    errs() << "Could not find main: " << toString(Main.takeError()) << '\n';
+    return 1;
+  }
+  int Result = Main->getAddress().toPtr<int (*)()>()();
+  flushd();
+
+  if (PrintStats) {
+    auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - StartTime);
+    errs() << "compiled functions: " << JIT->getCompiledFunctions() << " of "
+           << JIT->getDefinedFunctions() << '\n';
+    errs() << "time to result: " << Elapsed.count() << " ms\n";
+    if (JIT->tracksMemory())
+      errs() << "jit memory: " << JIT->getUsedBytes() << " of "
+             << JIT->getMappedBytes() << " mapped bytes used\n";
+    if (Cache)
+      errs() << "object cache: " << Cache->Hits << " hits, " << Cache->Misses
+             << " misses\n";
+  }
+  if (Options.PrintTierStats)
+    JIT->printTierStats(errs());
+  if (Cache)
+    Cache->prune();
+  return Result;
+}
+
 /// top ::= definition | external | expression | ';'
-static void MainLoop() {
+static void MainLoop(bool Interactive = false) {
   while (true) {
+    if (Interactive)
+      fprintf(stderr, "ready> ");
     switch (CurTok.Type) {
     case tok_eof:
       return;
@@ -47,7 +241,40 @@ static void MainLoop() {
   }
 }
 
+// read definitions and expressions from stdin, each compiled and run by the
+// JIT as soon as it has been entered. A file given on the command line is
+// loaded first.
+static int runREPL(const std::optional<std::string> &InputFile,
+                   const JITOptions &Options) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+  TheJIT = createJIT(Options);
+  InitializeModuleAndManagers();
+
+  std::stringstream preProcessed;
+  if (InputFile) {
+    std::set<std::string> includeFiles;
+    processFile(*InputFile, includeFiles, preProcessed);
+    TheLexer = std::make_unique<Lexer>(preProcessed);
+    getNextToken();
+    MainLoop();
+  }
+
+  TheLexer = std::make_unique<Lexer>(std::cin);
+  fprintf(stderr, "ready> ");
+  getNextToken();
+  MainLoop(/*Interactive=*/true);
+  flushd();
+  if (Options.PrintTierStats)
+    TheJIT->printTierStats(errs());
+  if (Options.Cache)
+    Options.Cache->prune();
+  return 0;
+}
+
 int main(int argc, char **argv) {
+  auto StartTime = std::chrono::steady_clock::now();
   argparse::ArgumentParser program("kaleidoscope");
   program.add_description("AOT compiler for the Kaleidoscope language.");
 
@@ -56,7 +283,154 @@ int main(int argc, char **argv) {
       .default_value(false)
       .implicit_value(true);
 
-  program.add_argument("input_file").help("The input source file to compile.");
+  program.add_argument("--whole-program")
+      .help("Internalize everything except main and externs, then run "
+            "interprocedural optimizations over the whole program.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--merge-toplevel")
+      .help("Emit top-level expressions into main instead of one function "
+            "per expression.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--toplevel-chunk")
+      .help("With --merge-toplevel, put at most N expressions in each "
+            "function called from main (0 means no limit).")
+      .default_value(0u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--memoize-pure")
+      .help("Cache the results of pure recursive functions, as if they "
+            "were declared with `def memo`.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--memo-size")
+      .help("Number of entries in each memoization cache, rounded up to a "
+            "power of two.")
+      .default_value(4096u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--memo-evict")
+      .help("What a full memoization cache does with new results: replace "
+            "an old entry or keep the existing entries.")
+      .default_value(std::string("replace"))
+      .choices("replace", "keep");
+
+  program.add_argument("--vector-library")
+      .help("Vector math library the optimizer may call when vectorizing "
+            "math functions in loops, used with --whole-program.")
+      .default_value(std::string("none"))
+      .choices("none", "libmvec", "sleef", "svml");
+
+  program.add_argument("-j", "--jobs")
+      .help("Split the module and emit object code on N threads, or with "
+            "--run and --repl, JIT compile on N threads.")
+      .default_value(1u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--cache-dir")
+      .help("Compile each function to its own object and reuse objects "
+            "from this directory when the function's IR is unchanged. With "
+            "--run and --repl, reuse JIT compiled objects from it.");
+
+  program.add_argument("--cache-size")
+      .help("Size limit of the object cache in MiB.")
+      .default_value(1024u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--stats")
+      .help("Print code size statistics to stderr, or compile statistics "
+            "with --run and the run time with --interpret or --vm.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--link-runtime-bitcode")
+      .help("Link the runtime's bitcode into the program so runtime calls "
+            "can be inlined.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--run")
+      .help("Compile the program in memory and run it instead of writing "
+            "an executable.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--repl")
+      .help("Read definitions and expressions from stdin and evaluate "
+            "them as they are entered, after loading input_file if given.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--interpret")
+      .help("Evaluate the program directly instead of compiling it, which "
+            "starts fastest but runs slowest.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--vm")
+      .help("Compile the program to bytecode and run it in a register VM, "
+            "which starts almost as fast as --interpret and runs faster.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--lazy")
+      .help("With --run or --repl, compile each function when it is first "
+            "called instead of when it is defined.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--tiered")
+      .help("With --run or --repl, compile functions without optimization "
+            "first and recompile them at -O3 on a background thread once "
+            "they are hot.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--tier-threshold")
+      .help("Number of calls after which --tiered recompiles a function.")
+      .default_value(1000u)
+      .scan<'u', unsigned>();
+
+  program.add_argument("--jit-stats")
+      .help("With --tiered, print how often each function was called before "
+            "it was recompiled when the program ends.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--jitlink")
+      .help("With --run or --repl, link JIT'd code with JITLink into "
+            "shared slabs of memory instead of with RuntimeDyld.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--perf-map")
+      .help("With --run or --repl, list JIT'd functions in "
+            "/tmp/perf-<pid>.map so perf can name them.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("--jitdump")
+      .help("With --run or --repl, write jitdump records of JIT'd code for "
+            "perf inject --jit, with source lines when combined with -g.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-g")
+      .help("Emit line tables mapping the generated code back to the source.")
+      .default_value(false)
+      .implicit_value(true);
+
+  program.add_argument("-o", "--output")
+      .help("Path of the executable to write.")
+      .default_value(std::string("a.out"));
+
+  program.add_argument("input_file")
+      .help("The input source file to compile.")
+      .nargs(argparse::nargs_pattern::optional);
 
   try {
     program.parse_args(argc, argv);
@@ -66,17 +440,104 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  std::string InputFile = program.get<std::string>("input_file");
+  auto InputFileArg = program.present<std::string>("input_file");
+  bool repl = program.get<bool>("--repl");
+  if (!InputFileArg && !repl) {
+    std::cerr << "Error: no input file\n";
+    std::cerr << program;
+    return 1;
+  }
+  std::string InputFile = InputFileArg.value_or("");
+  EmitDebugInfo = program.get<bool>("-g");
+  if (InputFileArg) {
+    SmallString<128> SourcePath(InputFile);
+    sys::fs::make_absolute(SourcePath);
+    DebugSourceFile = std::string(SourcePath);
+  }
   bool emitIR = program.get<bool>("--emit-ir");
+  bool wholeProgram = program.get<bool>("--whole-program");
+  bool printStats = program.get<bool>("--stats");
+  unsigned Jobs = std::max(program.get<unsigned>("--jobs"), 1u);
+  auto CacheDir = program.present<std::string>("--cache-dir");
+  uint64_t CacheSize = uint64_t(program.get<unsigned>("--cache-size")) << 20;
+  std::string OutputFile = program.get<std::string>("--output");
+  bool linkRuntimeBitcode = program.get<bool>("--link-runtime-bitcode");
+  bool runJIT = program.get<bool>("--run");
+  bool interpret = program.get<bool>("--interpret");
+  bool useVM = program.get<bool>("--vm");
+  if (interpret && useVM) {
+    errs() << "--interpret and --vm can't be combined\n";
+    return 1;
+  }
+  // the JIT already gets the runtime from the compiler itself
+  if (linkRuntimeBitcode && (runJIT || repl)) {
+    errs()
+        << "--link-runtime-bitcode can't be combined with --run or --repl\n";
+    return 1;
+  }
+  JITOptions JITOpts;
+  JITOpts.Lazy = program.get<bool>("--lazy");
+  JITOpts.Threads = Jobs;
+  JITOpts.UseJITLink = program.get<bool>("--jitlink");
+  if (program.get<bool>("--tiered"))
+    JITOpts.TierUpThreshold =
+        std::max(program.get<unsigned>("--tier-threshold"), 1u);
+  JITOpts.PrintTierStats = program.get<bool>("--jit-stats");
+  JITOpts.PerfMap = program.get<bool>("--perf-map");
+  JITOpts.JITDump = program.get<bool>("--jitdump");
+  if (JITOpts.Lazy && JITOpts.TierUpThreshold) {
+    errs() << "--lazy and --tiered can't be combined\n";
+    return 1;
+  }
+
+  std::string RuntimeLib = findRuntimeFile(argv[0], "libkdrt.a");
+  if (RuntimeLib.empty() && !runJIT && !repl && !interpret && !useVM) {
+    errs() << "Could not find the runtime library libkdrt.a\n";
+    return 1;
+  }
+  MergeTopLevel = program.get<bool>("--merge-toplevel");
+  TopLevelChunkSize = program.get<unsigned>("--toplevel-chunk");
+  MemoizePure = program.get<bool>("--memoize-pure");
+  MemoCacheSize = program.get<unsigned>("--memo-size");
+  MemoEvict = program.get<std::string>("--memo-evict") == "replace";
+  std::string VectorLibrary = program.get<std::string>("--vector-library");
+  VecLib = StringSwitch<TargetLibraryInfoImpl::VectorLibrary>(VectorLibrary)
+               .Case("libmvec", TargetLibraryInfoImpl::LIBMVEC_X86)
+               .Case("sleef", TargetLibraryInfoImpl::SLEEFGNUABI)
+               .Case("svml", TargetLibraryInfoImpl::SVML)
+               .Default(TargetLibraryInfoImpl::NoLibrary);
+  // with --run and --repl, JIT compiled modules are cached whole
+  std::unique_ptr<ObjectFileCache> Cache;
+  if (CacheDir)
+    Cache = std::make_unique<ObjectFileCache>(*CacheDir, CacheSize);
+  JITOpts.Cache = Cache.get();
+  if (repl)
+    return runREPL(InputFileArg, JITOpts);
+
   std::stringstream preProcessed;
   std::set<std::string> includeFiles;
   processFile(InputFile, includeFiles, preProcessed);
   TheLexer = std::make_unique<Lexer>(preProcessed);
   // fprintf(stderr, "ready> ");
   getNextToken();
+
+  // top level expressions are evaluated as they are read
+  if (interpret || useVM) {
+    Interpret = interpret;
+    UseVM = useVM;
+    MainLoop();
+    flushd();
+    if (printStats) {
+      auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - StartTime);
+      errs() << "time to result: " << Elapsed.count() << " ms\n";
+    }
+    return 0;
+  }
   InitializeModuleAndManagers();
 
   MainLoop();
+  FinishTopLevelExprs();
 
   if (!TopLevelFunctions.empty()) {
     llvm::FunctionType *MainFT =
@@ -91,12 +552,10 @@ int main(int argc, char **argv) {
       Builder->CreateCall(Fn, {});
     }
     Builder->CreateRet(llvm::ConstantInt::get(*TheContext, llvm::APInt(32, 0)));
-  } else {
+  } else if (!TheModule->getFunction("main")) {
     fprintf(stderr, "Warning: No top-level expressions to execute, main "
                     "function will not be generated.\n");
   }
-  if (emitIR)
-    TheModule->print(llvm::errs(), nullptr);
 
   InitializeAllTargetInfos();
   InitializeAllTargets();
@@ -119,41 +578,127 @@ int main(int argc, char **argv) {
   auto Features = "";
 
   TargetOptions opt;
-  auto TargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features,
-                                                   opt, Reloc::PIC_);
+  auto createTargetMachine = [&]() {
+    return std::unique_ptr<llvm::TargetMachine>(Target->createTargetMachine(
+        TargetTriple, CPU, Features, opt, Reloc::PIC_));
+  };
+  auto TargetMachine = createTargetMachine();
 
   TheModule->setDataLayout(TargetMachine->createDataLayout());
 
-  // now write our output file
-  auto Filename = "output.o";
-  std::error_code EC;
-  raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+  if (linkRuntimeBitcode) {
+    std::string RuntimeBitcode = findRuntimeFile(argv[0], "kdrt.bc");
+    SMDiagnostic Err;
+    std::unique_ptr<Module> Runtime =
+        RuntimeBitcode.empty() ? nullptr
+                               : parseIRFile(RuntimeBitcode, Err, *TheContext);
+    if (!Runtime) {
+      errs() << "Could not load the runtime bitcode kdrt.bc\n";
+      return 1;
+    }
+    Runtime->setTargetTriple(TheModule->getTargetTriple());
+    Runtime->setDataLayout(TheModule->getDataLayout());
+    if (Linker::linkModules(*TheModule, std::move(Runtime),
+                            Linker::Flags::LinkOnlyNeeded)) {
+      errs() << "Could not link the runtime bitcode\n";
+      return 1;
+    }
+  }
+
+  ModuleSize Before = getModuleSize(*TheModule);
+  OptimizeModule(TargetMachine.get(), wholeProgram);
+  ModuleSize After = getModuleSize(*TheModule);
+
+  if (emitIR)
+    TheModule->print(llvm::errs(), nullptr);
+
+  if (runJIT)
+    return runModule(JITOpts, printStats, StartTime);
 
-  if (EC) {
-    errs() << "Could not open file: " << EC.message();
+  SmallString<128> TmpPrefix, TmpDir;
+  sys::path::system_temp_directory(/*ErasedOnReboot=*/true, TmpPrefix);
+  sys::path::append(TmpPrefix, "kaleidoscope");
+  if (auto EC = sys::fs::createUniqueDirectory(TmpPrefix, TmpDir)) {
+    errs() << "Could not create temporary directory: " << EC.message();
     return 1;
   }
+  auto RemoveTmpDir =
+      llvm::make_scope_exit([&] { sys::fs::remove_directories(TmpDir); });
 
-  legacy::PassManager pass;
-  auto FileType = CodeGenFileType::ObjectFile;
+  std::vector<std::string> Filenames;
+  if (Cache) {
+    if (!emitCachedObjects(*TheModule, *TargetMachine, *Cache, Filenames))
+      return 1;
+  } else {
+    // now write our output files, one per partition of the module, into a
+    // directory of our own so concurrent compiles never share objects
+    std::vector<std::unique_ptr<raw_fd_ostream>> Dests;
+    for (unsigned i = 0; i != Jobs; ++i) {
+      SmallString<128> Filename(TmpDir);
+      sys::path::append(Filename, "output." + std::to_string(i) + ".o");
+      Filenames.push_back(std::string(Filename));
+      std::error_code EC;
+      Dests.push_back(std::make_unique<raw_fd_ostream>(Filenames.back(), EC,
+                                                       sys::fs::OF_None));
+      if (EC) {
+        errs() << "Could not open file: " << EC.message();
+        return 1;
+      }
+    }
 
-  if (TargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
-    errs() << "TargetMachine can't emit a file of this type";
-    return 1;
+    auto FileType = CodeGenFileType::ObjectFile;
+    if (Jobs == 1) {
+      legacy::PassManager pass;
+      if (TargetMachine->addPassesToEmitFile(pass, *Dests[0], nullptr,
+                                             FileType)) {
+        errs() << "TargetMachine can't emit a file of this type";
+        return 1;
+      }
+      pass.run(*TheModule);
+    } else {
+      // each partition is cloned into its own context and emitted on its
+      // own thread with a TargetMachine of its own
+      std::vector<raw_pwrite_stream *> OSs;
+      for (auto &Dest : Dests)
+        OSs.push_back(Dest.get());
+      splitCodeGen(*TheModule, OSs, {}, createTargetMachine, FileType);
+    }
   }
 
-  pass.run(*TheModule);
-  dest.flush();
+  uint64_t ObjectSize = 0;
+  for (auto &Filename : Filenames) {
+    uint64_t Size = 0;
+    sys::fs::file_size(Filename, Size);
+    ObjectSize += Size;
+  }
 
-  // outs() << "Wrote " << Filename << "\n";
+  if (printStats) {
+    errs() << "functions:    " << Before.Functions << " -> " << After.Functions
+           << '\n';
+    errs() << "instructions: " << Before.Instructions << " -> "
+           << After.Instructions << '\n';
+    errs() << "object size:  " << ObjectSize << " bytes\n";
+    if (Cache) {
+      unsigned Lookups = Cache->Hits + Cache->Misses;
+      errs() << "object cache: " << Cache->Hits << " hits, " << Cache->Misses
+             << " misses";
+      if (Lookups)
+        errs() << " (" << Cache->Hits * 100 / Lookups << "% hit rate)";
+      errs() << '\n';
+    }
+  }
 
   LLVMDisposeMessage(TargetTriple);
 
-  std::string LinkerCmd = "clang++ output.o runtime.o";
-  int RetCode = system(LinkerCmd.c_str());
-  if (RetCode != 0) {
-    errs() << "Linking failed with exit code " << RetCode << '\n';
+  Filenames.push_back(RuntimeLib);
+  // vectorized calls resolve against the library itself
+  if (VectorLibrary == "libmvec")
+    Filenames.push_back("-lmvec");
+  else if (VectorLibrary == "sleef")
+    Filenames.push_back("-lsleefgnuabi");
+  else if (VectorLibrary == "svml")
+    Filenames.push_back("-lsvml");
+  if (!linkExecutable(Filenames, OutputFile))
     return 1;
-  }
   return 0;
 }
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Time cold, warm and edit-one-function rebuilds with the per-function
+# object cache, then cold and warm starts of --run with the JIT's object
+# cache. Run from the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+N=${N:-2000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+gen() {
+  {
+    echo "extern printd(x);"
+    sh bench/gen-functions.sh "$N" "$1"
+    echo "printd(f0(1, 2) + f$((N - 1))(3, 4))"
+  } > "$DIR/prog.kd"
+}
+
+gen 0
+echo "== cold"
+time $KD --stats --cache-dir "$DIR/cache" "$DIR/prog.kd"
+echo "== unchanged"
+time $KD --stats --cache-dir "$DIR/cache" "$DIR/prog.kd"
+gen 1
+echo "== one function edited"
+time $KD --stats --cache-dir "$DIR/cache" "$DIR/prog.kd"
+
+rm -rf "$DIR/cache"
+echo "== --run cold"
+$KD --run --stats --cache-dir "$DIR/cache" "$DIR/prog.kd"
+echo "== --run warm"
+$KD --run --stats --cache-dir "$DIR/cache" "$DIR/prog.kd"
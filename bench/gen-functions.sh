@@ -0,0 +1,11 @@
+#!/bin/sh
+# Print N definitions f0(x y) to f<N-1>(x y) for the benchmarks that need a
+# program with many functions. EDIT, when given, is added to a constant in
+# f0 so only that function changes.
+# Usage: bench/gen-functions.sh N [EDIT]
+awk -v n="$1" -v edit="${2:-0}" 'BEGIN {
+  for (i = 0; i < n; i++) {
+    k = (i == 0) ? i + edit : i
+    printf "def f%d(x y) if x < y then (x * %d + y) / (y + %d) else x - y * %d;\n", i, k, i + 1, i
+  }
+}'
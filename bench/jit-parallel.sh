@@ -0,0 +1,29 @@
+#!/bin/sh
+# Time --run on a synthetic program with many functions, JIT compiling on
+# one thread and on every core, eagerly and lazily. Run from the repository
+# root.
+set -e
+KD=${KD:-build/kaleidoscope}
+N=${N:-10000}
+JOBS=${JOBS:-$(nproc)}
+SRC=$(mktemp --suffix=.kd)
+trap 'rm -f "$SRC"' EXIT
+
+{
+  echo "extern printd(x);"
+  sh bench/gen-functions.sh "$N"
+  awk -v n="$N" 'BEGIN {
+    printf "def all(x) x"
+    for (i = 0; i < n; i++)
+      printf " + f%d(x, 2)", i
+    print ";"
+    print "printd(all(1))"
+  }'
+} > "$SRC"
+
+for mode in "" --lazy; do
+  for j in 1 "$JOBS"; do
+    echo "== --run $mode -j $j"
+    $KD --run $mode -j "$j" --stats "$SRC"
+  done
+done
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Average end-to-end latency of the demo programs, compiling and linking an
+# executable and then running it, against compiling and running them in
+# memory with --run and evaluating them with --interpret. Run from the
+# repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+RUNS=${RUNS:-20}
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+# time_runs LABEL COMMAND... runs COMMAND $RUNS times and prints the average
+time_runs() {
+  label=$1
+  shift
+  start=$(date +%s%N)
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    "$@"
+    i=$((i + 1))
+  done
+  end=$(date +%s%N)
+  echo "$label: $(( (end - start) / RUNS / 1000000 )) ms"
+}
+
+aot() {
+  $KD -o "$OUT" "$1" && "$OUT" 2>/dev/null
+}
+
+run() {
+  $KD "$@" 2>/dev/null
+}
+
+for prog in demo/factorial.kd demo/fib.kd demo/for.kd demo/set.kd; do
+  time_runs "$prog" aot "$prog"
+  time_runs "$prog --run" run --run "$prog"
+  time_runs "$prog --interpret" run --interpret "$prog"
+done
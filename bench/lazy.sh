@@ -0,0 +1,21 @@
+#!/bin/sh
+# Run a script that uses two functions of a large included library with
+# --run, compiling everything up front and compiling functions on first
+# call. Run from the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+N=${N:-10000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+sh bench/gen-functions.sh "$N" > "$DIR/lib.kd"
+cat > "$DIR/main.kd" <<EOF
+include "lib.kd"
+extern printd(x);
+printd(f0(1, 2) + f$((N - 1))(3, 4))
+EOF
+
+for mode in "" --lazy; do
+  echo "== --run $mode"
+  $KD --run $mode --stats "$DIR/main.kd"
+done
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Compare plain and memoized fib(40). Run from the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+for prog in fib40 fib40-memo; do
+  $KD -o "$OUT" bench/$prog.kd
+  echo "== $prog"
+  time "$OUT"
+done
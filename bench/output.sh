@@ -0,0 +1,14 @@
+#!/bin/sh
+# Count write syscalls and time the output heavy programs. Needs strace.
+# Run from the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+EXE=$(mktemp)
+trap 'rm -f "$EXE"' EXIT
+
+for prog in demo/set.kd bench/output.kd; do
+  $KD -o "$EXE" "$prog"
+  echo "== $prog"
+  strace -c -e trace=write "$EXE" 2>&1 >/dev/null | grep -E 'calls|write'
+  time "$EXE" 2>/dev/null
+done
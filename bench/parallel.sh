@@ -0,0 +1,20 @@
+#!/bin/sh
+# Time object emission of a synthetic program with many functions on one
+# thread and on every core. Run from the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+N=${N:-10000}
+JOBS=${JOBS:-$(nproc)}
+SRC=$(mktemp --suffix=.kd)
+trap 'rm -f "$SRC"' EXIT
+
+{
+  echo "extern printd(x);"
+  sh bench/gen-functions.sh "$N"
+  echo "printd(f0(1, 2) + f$((N - 1))(3, 4))"
+} > "$SRC"
+
+for j in 1 "$JOBS"; do
+  echo "== -j $j"
+  time $KD -j "$j" "$SRC"
+done
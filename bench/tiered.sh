@@ -0,0 +1,13 @@
+#!/bin/sh
+# Compare --run with and without --tiered on a short script, where compile
+# time dominates, and on fib(40), where the code has to be fast. Run from
+# the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+
+for prog in demo/set.kd bench/fib40.kd; do
+  for mode in "" --tiered; do
+    echo "== $prog --run $mode"
+    $KD --run $mode --stats --jit-stats "$prog"
+  done
+done
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Compare the bytecode VM with a compiled executable, the JIT and the
+# interpreter on recursion (fib(40)), the Mandelbrot demo and a loop heavy
+# program. Run from the repository root; the VM is built with computed goto
+# dispatch unless configured with -DKALEIDOSCOPE_VM_SWITCH=ON.
+set -e
+KD=${KD:-build/kaleidoscope}
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+# elapsed LABEL COMMAND... prints how long COMMAND took
+elapsed() {
+  label=$1
+  shift
+  start=$(date +%s%N)
+  "$@" >/dev/null 2>&1
+  end=$(date +%s%N)
+  echo "$label: $(( (end - start) / 1000000 )) ms"
+}
+
+aot() {
+  $KD -o "$OUT" "$1" && "$OUT"
+}
+
+for prog in bench/fib40.kd demo/set.kd bench/loop.kd; do
+  elapsed "$prog" aot "$prog"
+  elapsed "$prog --run" $KD --run "$prog"
+  elapsed "$prog --vm" $KD --vm "$prog"
+  elapsed "$prog --interpret" $KD --interpret "$prog"
+done
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Code size and run time of the demo programs with and without
+# --whole-program. Run from the repository root.
+set -e
+KD=${KD:-build/kaleidoscope}
+OUT=$(mktemp)
+trap 'rm -f "$OUT"' EXIT
+
+for prog in demo/factorial.kd demo/fib.kd demo/fibi.kd demo/for.kd \
+    demo/set.kd; do
+  for mode in "" --whole-program; do
+    echo "== $prog $mode"
+    $KD $mode --stats -o "$OUT" "$prog"
+    start=$(date +%s%N)
+    "$OUT" >/dev/null 2>&1
+    end=$(date +%s%N)
+    echo "run time:     $(( (end - start) / 1000000 )) ms"
+  done
+done
@@ -1,31 +1,48 @@
 #include "include/codegen.h"
 #include "include/AST.h"
+#include "include/interpreter.h"
 #include "include/parser.h"
+#include "include/runtime.h"
+#include "include/vm.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/bit.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/CGSCCPassManager.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassInstrumentation.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/SCCP.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include <cstdio>
 #include <map>
 #include <memory>
+#include <set>
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -33,10 +50,47 @@ using namespace llvm::orc;
 std::unique_ptr<LLVMContext> TheContext;
 std::unique_ptr<Module> TheModule;
 std::vector<llvm::Function *> TopLevelFunctions;
+// emit top level expressions into shared functions instead of one function
+// each, a chunk size of 0 puts all of them straight into main
+bool MergeTopLevel = false;
+unsigned TopLevelChunkSize = 0;
+static Function *TopLevelChunk = nullptr;
+static BasicBlock *TopLevelTail = nullptr;
+static Value *LastTopLevelValue = nullptr;
+static unsigned TopLevelChunkExprs = 0;
+// memoization of `def memo` functions, and of pure recursive functions when
+// MemoizePure is set. Each function gets an open addressing table of
+// MemoCacheSize entries; with MemoEvict a miss on a full probe sequence
+// replaces the home slot, otherwise the result is not cached.
+bool MemoizePure = false;
+unsigned MemoCacheSize = 4096;
+bool MemoEvict = true;
+static const unsigned MemoProbes = 8;
+// vector math library the loop vectorizer may call for math intrinsics
+TargetLibraryInfoImpl::VectorLibrary VecLib = TargetLibraryInfoImpl::NoLibrary;
 std::unique_ptr<IRBuilder<>> Builder;
+// with -g, line tables for the module being generated, naming
+// DebugSourceFile. Finalized when the module is optimized.
+bool EmitDebugInfo = false;
+std::string DebugSourceFile = "<stdin>";
+static std::unique_ptr<DIBuilder> DBuilder;
+static DICompileUnit *TheCU = nullptr;
 static std::map<std::string, AllocaInst *> NamedValues;
 static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-// std::unique_ptr<KaleidoscopeJIT> TheJIT;
+// loop header and argument slots of the function being generated, used to
+// turn self recursive tail calls into jumps
+static BasicBlock *TailRecurseBB = nullptr;
+static std::vector<AllocaInst *> ArgAllocas;
+// set in the REPL, where every definition and expression is handed to the
+// JIT as soon as it has been read
+std::unique_ptr<KaleidoscopeJIT> TheJIT;
+// evaluate the program with the interpreter instead of generating code
+bool Interpret = false;
+// or compile it to bytecode for the VM in vm.cpp
+bool UseVM = false;
+// the JIT can't replace a definition, so a function redefined in the REPL is
+// emitted under a new symbol that code compiled afterwards links against
+static std::map<std::string, unsigned> FunctionVersions;
 ExitOnError ExitOnErr;
 
 AllocaInst *CreateEntryBlockAlloca(Function *TheFucntion, StringRef VarName) {
@@ -45,15 +99,37 @@ AllocaInst *CreateEntryBlockAlloca(Function *TheFucntion, StringRef VarName) {
   return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
 }
 
+// attribute the instructions emitted from here on to E, unless the function
+// being generated has no debug info
+static void EmitLocation(const ExprAST &E) {
+  if (!DBuilder)
+    return;
+  DISubprogram *SP = Builder->GetInsertBlock()->getParent()->getSubprogram();
+  if (!SP) {
+    Builder->SetCurrentDebugLocation(DebugLoc());
+    return;
+  }
+  Builder->SetCurrentDebugLocation(
+      DILocation::get(*TheContext, E.getLine(), E.getCol(), SP));
+}
+
 Value *LogErrorV(const char *Str, SourceLocation Loc) {
   // LogError<ExprAST>(Str);
   fprintf(stderr, "Error (Line %d, Col %d): %s\n", Loc.Line, Loc.Col, Str);
   return nullptr;
 }
 
+// symbol of the current definition of the function Name
+static std::string getSymbolName(const std::string &Name) {
+  auto It = FunctionVersions.find(Name);
+  if (It == FunctionVersions.end() || It->second == 0)
+    return Name;
+  return Name + "." + std::to_string(It->second);
+}
+
 Function *getFunction(std::string Name) {
   // has the function already added to current module
-  if (auto *F = TheModule->getFunction(Name))
+  if (auto *F = TheModule->getFunction(getSymbolName(Name)))
     return F;
 
   // can existing prototypes codgen this function
@@ -68,18 +144,132 @@ Value *NumberExprAST::codegen() {
   return ConstantFP::get(*TheContext, APFloat(m_Val));
 }
 
+Value *StringExprAST::codegen() {
+  Value *Str = Builder->CreateGlobalString(m_Val, "str");
+  Value *Bits = Builder->CreatePtrToInt(Str, Builder->getInt64Ty());
+  return Builder->CreateBitCast(Bits, Builder->getDoubleTy(), "str");
+}
+
 Value *VariableExprAST::codegen() {
   AllocaInst *A = NamedValues[m_Name];
   if (!A)
     return LogErrorV("Unkown variable name", getLocation());
+  EmitLocation(*this);
   return Builder->CreateLoad(A->getAllocatedType(), A, m_Name.c_str());
 }
 
+// arrays are passed around as doubles holding the bits of a pointer to their
+// first element, the runtime keeps the length in the 8 bytes before it.
+// Mapped files use the same layout so they can be indexed like any array.
+static Value *ArrayPointer(Value *Handle) {
+  Value *Bits = Builder->CreateBitCast(Handle, Builder->getInt64Ty());
+  return Builder->CreateIntToPtr(Bits, Builder->getPtrTy(), "array");
+}
+
+static Value *ArrayHandle(Value *Array) {
+  Value *Bits = Builder->CreatePtrToInt(Array, Builder->getInt64Ty());
+  return Builder->CreateBitCast(Bits, Builder->getDoubleTy(), "array");
+}
+
+static Value *ArrayLength(Value *Array) {
+  Value *LenPtr =
+      Builder->CreateConstGEP1_64(Builder->getInt64Ty(), Array, -1, "lenptr");
+  LoadInst *Len = Builder->CreateLoad(Builder->getInt64Ty(), LenPtr, "len");
+  // arrays are never resized, so the load can be hoisted and CSE'd freely
+  Len->setMetadata(LLVMContext::MD_invariant_load,
+                   MDNode::get(*TheContext, {}));
+  return Len;
+}
+
+// element number for a double index, fractions are dropped and values out of
+// range saturate so they fail the bounds check. fptosi.sat turns NaN into 0,
+// so NaN is mapped to INT64_MIN to fail it too.
+static Value *ArrayIndex(Value *Index) {
+  Value *Idx = Builder->CreateIntrinsic(
+      Intrinsic::fptosi_sat, {Builder->getInt64Ty(), Index->getType()},
+      {Index});
+  return Builder->CreateSelect(Builder->CreateFCmpUNO(Index, Index),
+                               Builder->getInt64(INT64_MIN), Idx);
+}
+
+// continue only if Idx is an element of Array, otherwise the runtime reports
+// the access and exits
+static void EmitBoundsCheck(Value *Array, Value *Idx, SourceLocation Loc) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  BasicBlock *FailBB =
+      BasicBlock::Create(*TheContext, "outofbounds", TheFunction);
+  BasicBlock *InBoundsBB =
+      BasicBlock::Create(*TheContext, "inbounds", TheFunction);
+  Value *Len = ArrayLength(Array);
+  Builder->CreateCondBr(Builder->CreateICmpULT(Idx, Len, "inbounds"),
+                        InBoundsBB, FailBB);
+
+  Builder->SetInsertPoint(FailBB);
+  FunctionCallee OutOfBounds = TheModule->getOrInsertFunction(
+      "kdarray_oob", Builder->getVoidTy(), Builder->getInt64Ty(),
+      Builder->getInt64Ty(), Builder->getInt32Ty());
+  if (auto *F = dyn_cast<Function>(OutOfBounds.getCallee())) {
+    F->setDoesNotReturn();
+    F->setDoesNotThrow();
+    F->addFnAttr(Attribute::Cold);
+  }
+  Builder->CreateCall(OutOfBounds, {Idx, Len, Builder->getInt32(Loc.Line)});
+  Builder->CreateUnreachable();
+
+  Builder->SetInsertPoint(InBoundsBB);
+}
+
+static Value *EmitElementPointer(Value *Array, Value *IndexVal, bool Checked,
+                                 SourceLocation Loc) {
+  Value *Idx = ArrayIndex(IndexVal);
+  if (Checked)
+    EmitBoundsCheck(Array, Idx, Loc);
+  return Builder->CreateInBoundsGEP(Builder->getDoubleTy(), Array, Idx,
+                                    "elemptr");
+}
+
+Value *IndexExprAST::codegenAddress() {
+  AllocaInst *A = NamedValues[m_Array];
+  if (!A)
+    return LogErrorV("Unkown variable name", getLocation());
+  EmitLocation(*this);
+  Value *Array = ArrayPointer(
+      Builder->CreateLoad(A->getAllocatedType(), A, m_Array.c_str()));
+  if (m_Element)
+    return Builder->CreateInBoundsGEP(Builder->getDoubleTy(), Array, m_Element,
+                                      "elemptr");
+  Value *IndexVal = m_Index->codegen();
+  if (!IndexVal)
+    return nullptr;
+  EmitLocation(*this);
+  return EmitElementPointer(Array, IndexVal, m_Checked, getLocation());
+}
+
+Value *IndexExprAST::codegen() {
+  Value *Elem = codegenAddress();
+  if (!Elem)
+    return nullptr;
+  return Builder->CreateLoad(Builder->getDoubleTy(), Elem, "elem");
+}
+
 Value *BinaryExprAST::codegen() {
 
   // Special edge case because we don't want LHS as an expression
   if (m_Op == '=') {
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(m_LHS.get());
+    // a[i] = x stores to the element
+    if (auto *LHSI = dynamic_cast<IndexExprAST *>(m_LHS.get())) {
+      Value *Val = m_RHS->codegen();
+      if (!Val)
+        return nullptr;
+      Value *Elem = LHSI->codegenAddress();
+      if (!Elem)
+        return nullptr;
+      EmitLocation(*this);
+      Builder->CreateStore(Val, Elem);
+      return Val;
+    }
+
+    VariableExprAST *LHSE = dynamic_cast<VariableExprAST *>(m_LHS.get());
     if (!LHSE)
       return LogErrorV("Unknown variable name", getLocation());
 
@@ -92,6 +282,7 @@ Value *BinaryExprAST::codegen() {
     Value *Variable = NamedValues[LHSE->getName()];
     if (!Variable)
       return LogErrorV("Unknown variable name", getLocation());
+    EmitLocation(*this);
     Builder->CreateStore(Val, Variable);
     return Val;
   }
@@ -101,6 +292,7 @@ Value *BinaryExprAST::codegen() {
   if (!L || !R)
     return nullptr;
 
+  EmitLocation(*this);
   switch (m_Op) {
   case '+':
     return Builder->CreateFAdd(L, R, "addtmp");
@@ -125,7 +317,82 @@ Value *BinaryExprAST::codegen() {
   return Builder->CreateCall(F, Ops, "binop");
 }
 
+// extern math functions with an LLVM intrinsic of the same meaning, calls to
+// them are emitted as the intrinsic so they can be folded and vectorized
+static Intrinsic::ID getMathIntrinsic(StringRef Name, unsigned NumArgs) {
+  static const struct {
+    const char *Name;
+    unsigned NumArgs;
+    Intrinsic::ID ID;
+  } MathIntrinsics[] = {
+      {"sqrt", 1, Intrinsic::sqrt}, {"sin", 1, Intrinsic::sin},
+      {"cos", 1, Intrinsic::cos},   {"exp", 1, Intrinsic::exp},
+      {"log", 1, Intrinsic::log},   {"pow", 2, Intrinsic::pow},
+      {"fabs", 1, Intrinsic::fabs}, {"floor", 1, Intrinsic::floor},
+      {"fma", 3, Intrinsic::fma},
+  };
+  for (auto &MI : MathIntrinsics)
+    if (Name == MI.Name && NumArgs == MI.NumArgs)
+      return MI.ID;
+  return Intrinsic::not_intrinsic;
+}
+
+// an empty asm statement that clobbers memory, so loads and stores of the
+// timed code are not moved across a timer read. Calls that never write memory
+// are kept in place by KeepTimedCallsPass.
+static void EmitCompilerBarrier() {
+  FunctionType *FT = FunctionType::get(Builder->getVoidTy(), false);
+  Builder->CreateCall(FT, InlineAsm::get(FT, "", "~{memory}", true));
+}
+
+static bool isArrayBuiltin(const std::string &Name, unsigned NumArgs) {
+  return kdarray_builtin(Name, NumArgs, [](const std::string &Name) {
+    return getFunction(Name) != nullptr;
+  });
+}
+
+bool CallExprAST::isLoopInvariant(const ExprAST &Body,
+                                  const std::string &LoopVar) const {
+  // an array keeps its length
+  return (m_Callee == "len" || m_Callee == "maplen") &&
+         isArrayBuiltin(m_Callee, m_Args.size()) &&
+         m_Args[0]->isLoopInvariant(Body, LoopVar);
+}
+
 Value *CallExprAST::codegen() {
+  if (isArrayBuiltin(m_Callee, m_Args.size())) {
+    std::vector<Value *> ArgsV;
+    for (auto &Arg : m_Args) {
+      ArgsV.push_back(Arg->codegen());
+      if (!ArgsV.back())
+        return nullptr;
+    }
+    EmitLocation(*this);
+    if (m_Callee == "len" || m_Callee == "maplen")
+      return Builder->CreateUIToFP(ArrayLength(ArrayPointer(ArgsV[0])),
+                                   Builder->getDoubleTy(), "len");
+    // an inline load, so streaming over a mapped file costs no calls
+    if (m_Callee == "loadd")
+      return Builder->CreateLoad(
+          Builder->getDoubleTy(),
+          EmitElementPointer(ArrayPointer(ArgsV[0]), ArgsV[1], true,
+                             getLocation()),
+          "elem");
+
+    FunctionCallee New =
+        m_Callee == "array"
+            ? TheModule->getOrInsertFunction("kdarray_new", Builder->getPtrTy(),
+                                             Builder->getDoubleTy())
+            : TheModule->getOrInsertFunction("kdarray_map", Builder->getPtrTy(),
+                                             Builder->getPtrTy());
+    if (auto *F = dyn_cast<Function>(New.getCallee())) {
+      F->setReturnDoesNotAlias();
+      F->setDoesNotThrow();
+    }
+    Value *Arg = m_Callee == "array" ? ArgsV[0] : ArrayPointer(ArgsV[0]);
+    return ArrayHandle(Builder->CreateCall(New, {Arg}, "array"));
+  }
+
   // lookup name in global module table
   Function *CalleeF = getFunction(m_Callee);
   if (!CalleeF)
@@ -135,13 +402,68 @@ Value *CallExprAST::codegen() {
   if (CalleeF->arg_size() != m_Args.size())
     return LogErrorV("Incorrect # of arguments", getLocation());
 
+  // bench(f, n) is handed the function f itself rather than its value, the
+  // runtime calls it through the pointer n times
+  if (m_Callee == "bench" && CalleeF->isDeclaration() && m_Args.size() == 2)
+    if (auto *Fn = dynamic_cast<VariableExprAST *>(m_Args[0].get()))
+      if (!NamedValues.count(Fn->getName())) {
+        Function *Timed = getFunction(Fn->getName());
+        if (!Timed || Timed->arg_size() != 0)
+          return LogErrorV("bench expects a function without arguments",
+                           getLocation());
+        Value *Iters = m_Args[1]->codegen();
+        if (!Iters)
+          return nullptr;
+        EmitLocation(*this);
+        FunctionCallee KDBench = TheModule->getOrInsertFunction(
+            "kdbench", Builder->getDoubleTy(), Builder->getPtrTy(),
+            Builder->getDoubleTy());
+        return Builder->CreateCall(KDBench, {Timed, Iters}, "calltmp");
+      }
+
   std::vector<Value *> ArgsV;
   for (unsigned i = 0, e = m_Args.size(); i != e; i++) {
     ArgsV.push_back(m_Args[i]->codegen());
     if (!ArgsV.back())
       return nullptr;
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  EmitLocation(*this);
+
+  // a self call in tail position is a loop, rebind the arguments and jump
+  // back to the top of the body so deep recursion runs in constant stack
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  if (m_IsTail && CalleeF == TheFunction && TailRecurseBB) {
+    for (unsigned i = 0, e = ArgsV.size(); i != e; i++)
+      Builder->CreateStore(ArgsV[i], ArgAllocas[i]);
+    Builder->CreateBr(TailRecurseBB);
+    return PoisonValue::get(Type::getDoubleTy(*TheContext));
+  }
+
+  // only externs, a user definition named sin keeps its own meaning
+  if (CalleeF->isDeclaration()) {
+    Intrinsic::ID ID = getMathIntrinsic(m_Callee, ArgsV.size());
+    if (ID != Intrinsic::not_intrinsic)
+      return Builder->CreateIntrinsic(ID, {Type::getDoubleTy(*TheContext)},
+                                      ArgsV);
+
+    if (ArgsV.empty() && (m_Callee == "clockd" || m_Callee == "rdtscd")) {
+      EmitCompilerBarrier();
+      Value *Time;
+      if (m_Callee == "rdtscd")
+        Time = Builder->CreateUIToFP(
+            Builder->CreateIntrinsic(Intrinsic::readcyclecounter, {}, {}),
+            Builder->getDoubleTy(), "calltmp");
+      else
+        Time = Builder->CreateCall(CalleeF, {}, "calltmp");
+      EmitCompilerBarrier();
+      return Time;
+    }
+  }
+
+  CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  if (m_IsTail)
+    Call->setTailCall();
+  return Call;
 }
 
 Function *PrototypeAST::codegen() {
@@ -153,12 +475,20 @@ Function *PrototypeAST::codegen() {
       FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
 
   Function *F =
-      Function::Create(FT, Function::ExternalLinkage, m_Name, TheModule.get());
+      Function::Create(FT, Function::ExternalLinkage, getSymbolName(m_Name),
+                       TheModule.get());
 
   unsigned Idx = 0;
   for (auto &Arg : F->args())
     Arg.setName(m_Args[Idx++]);
 
+  if (m_IsPure) {
+    F->setDoesNotAccessMemory();
+    F->setDoesNotThrow();
+    F->addFnAttr(Attribute::WillReturn);
+    F->addFnAttr(Attribute::Speculatable);
+  }
+
   return F;
 }
 
@@ -175,14 +505,35 @@ Function *FunctionAST::codegen() {
   if (P.isBinaryOp())
     BinopPrecedence[P.getOperatorName()] = P.getBianryPrecedence();
 
+  // operators are tiny helpers that are only reachable through expressions in
+  // this module, so keep them local and fold them into every use site. In the
+  // REPL later modules call them, so they stay visible there.
+  if (P.isUnaryOp() || P.isBinaryOp()) {
+    if (!TheJIT)
+      TheFunction->setLinkage(Function::InternalLinkage);
+    TheFunction->addFnAttr(Attribute::AlwaysInline);
+  }
+
   // now that we've checked that funnction body is empty
   BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
   Builder->SetInsertPoint(BB);
 
+  if (DBuilder) {
+    unsigned Line = m_Body->getLine();
+    DISubprogram *SP = DBuilder->createFunction(
+        TheCU->getFile(), P.getName(), TheFunction->getName(),
+        TheCU->getFile(), Line,
+        DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray({})),
+        Line, DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    TheFunction->setSubprogram(SP);
+    EmitLocation(*m_Body);
+  }
+
   // record fun arguments in Namedvalues
   std::map<std::string, AllocaInst *> OldBindings;
   OldBindings.swap(NamedValues);
   NamedValues.clear();
+  ArgAllocas.clear();
   for (auto &Arg : TheFunction->args()) {
     // create an Alloca for this variable
     AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
@@ -190,11 +541,26 @@ Function *FunctionAST::codegen() {
     Builder->CreateStore(&Arg, Alloca);
 
     NamedValues[std::string(Arg.getName())] = Alloca;
+    ArgAllocas.push_back(Alloca);
   }
 
-  if (Value *RetVal = m_Body->codegen()) {
-    // finish the function
-    Builder->CreateRet(RetVal);
+  // self recursive tail calls branch back to here
+  TailRecurseBB = BasicBlock::Create(*TheContext, "tailrecurse", TheFunction);
+  Builder->CreateBr(TailRecurseBB);
+  Builder->SetInsertPoint(TailRecurseBB);
+
+  m_Body->markTail();
+  Value *RetVal = m_Body->codegen();
+  TailRecurseBB = nullptr;
+  if (RetVal) {
+    // finish the function, unless the body ended in a tail jump
+    if (!Builder->GetInsertBlock()->getTerminator())
+      Builder->CreateRet(RetVal);
+    // code emitted outside of definitions has no debug info
+    Builder->SetCurrentDebugLocation(DebugLoc());
+
+    if (P.isMemo())
+      TheFunction->addFnAttr("kaleidoscope-memo");
 
     // validate the generated code for consistency
     verifyFunction(*TheFunction, &llvm::errs());
@@ -206,6 +572,7 @@ Function *FunctionAST::codegen() {
   }
 
   /// reading erorr remove the function
+  Builder->SetCurrentDebugLocation(DebugLoc());
   TheFunction->eraseFromParent();
   NamedValues.swap(OldBindings);
   if (P.isBinaryOp())
@@ -221,6 +588,7 @@ Value *IfExprAST::codegen() {
     return nullptr;
 
   // convert condition to bool
+  EmitLocation(*this);
   CondV = Builder->CreateFCmpONE(
       CondV, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
   Function *TheFunction = Builder->GetInsertBlock()->getParent();
@@ -238,9 +606,12 @@ Value *IfExprAST::codegen() {
   Value *ThenV = m_Then->codegen();
   if (!ThenV)
     return nullptr;
-  Builder->CreateBr(MergeBB);
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
+  // A tail call turned into a jump has already terminated it.
   ThenBB = Builder->GetInsertBlock();
+  bool ThenReachesMerge = !ThenBB->getTerminator();
+  if (ThenReachesMerge)
+    Builder->CreateBr(MergeBB);
 
   // emit else block
   TheFunction->insert(TheFunction->end(), ElseBB);
@@ -248,19 +619,92 @@ Value *IfExprAST::codegen() {
   Value *ElseV = m_Else->codegen();
   if (!ElseV)
     return nullptr;
-  Builder->CreateBr(MergeBB);
   ElseBB = Builder->GetInsertBlock();
+  bool ElseReachesMerge = !ElseBB->getTerminator();
+  if (ElseReachesMerge)
+    Builder->CreateBr(MergeBB);
+
+  // both arms jumped back to the loop header, nothing flows past the if
+  if (!ThenReachesMerge && !ElseReachesMerge) {
+    delete MergeBB;
+    return PoisonValue::get(Type::getDoubleTy(*TheContext));
+  }
 
   // emit merge block
   TheFunction->insert(TheFunction->end(), MergeBB);
   Builder->SetInsertPoint(MergeBB);
   PHINode *PN = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
-  PN->addIncoming(ThenV, ThenBB);
-  PN->addIncoming(ElseV, ElseBB);
+  if (ThenReachesMerge)
+    PN->addIncoming(ThenV, ThenBB);
+  if (ElseReachesMerge)
+    PN->addIncoming(ElseV, ElseBB);
 
   return PN;
 }
 
+// With a step of 1 and an end condition `i < n` where n does not change in
+// the loop, the loop variable runs from Start up to the first value that is
+// not below n. Array accesses indexed by it on every iteration are checked
+// for those two values before the loop and left unchecked inside, at the
+// cost of reporting an out of bounds loop before its first iteration.
+bool ForExprAST::hoistBoundsChecks(Value *StartVal,
+                                   std::vector<IndexExprAST *> &Hoisted,
+                                   Value *&Last) {
+  auto *Step = dynamic_cast<NumberExprAST *>(m_Step.get());
+  auto *End = dynamic_cast<BinaryExprAST *>(m_End.get());
+  if ((m_Step && (!Step || Step->getVal() != 1.0)) || !End ||
+      End->getOp() != '<' || m_Body->assigns(m_VarName))
+    return true;
+  auto *EndVar = dynamic_cast<VariableExprAST *>(&End->getLHS());
+  if (!EndVar || EndVar->getName() != m_VarName ||
+      !End->getRHS().isLoopInvariant(*m_Body, m_VarName))
+    return true;
+
+  std::vector<IndexExprAST *> Indexes;
+  m_Body->collectIndexes(Indexes);
+  for (IndexExprAST *Index : Indexes) {
+    auto *IndexVar = dynamic_cast<VariableExprAST *>(&Index->getIndex());
+    if (IndexVar && IndexVar->getName() == m_VarName &&
+        Index->getArray() != m_VarName && !m_Body->assigns(Index->getArray()))
+      Hoisted.push_back(Index);
+  }
+  if (Hoisted.empty())
+    return true;
+
+  // the loop variable is not in scope yet, which is fine as the bound
+  // doesn't use it
+  Value *Limit = End->getRHS().codegen();
+  if (!Limit)
+    return false;
+  Type *DoubleTy = Builder->getDoubleTy();
+  Value *Steps = Builder->CreateUnaryIntrinsic(
+      Intrinsic::ceil, Builder->CreateFSub(Limit, StartVal));
+  Last = Builder->CreateSelect(Builder->CreateFCmpOLT(StartVal, Limit),
+                                     Builder->CreateFAdd(StartVal, Steps),
+                                     StartVal, "last");
+  // a NaN bound never ends the loop, so it runs past any array
+  Last = Builder->CreateSelect(Builder->CreateFCmpUNO(Limit, Limit),
+                               ConstantFP::getInfinity(DoubleTy), Last,
+                               "last");
+
+  std::set<std::string> Checked;
+  for (IndexExprAST *Index : Hoisted) {
+    if (Checked.insert(Index->getArray()).second) {
+      AllocaInst *A = NamedValues[Index->getArray()];
+      if (!A) {
+        LogErrorV("Unkown variable name", Index->getLocation());
+        return false;
+      }
+      Value *Array =
+          ArrayPointer(Builder->CreateLoad(DoubleTy, A, Index->getArray()));
+      EmitBoundsCheck(Array, ArrayIndex(StartVal), Index->getLocation());
+      EmitBoundsCheck(Array, ArrayIndex(Last), Index->getLocation());
+    }
+    Index->setUnchecked();
+  }
+  return true;
+}
+
 Value *ForExprAST::codegen() {
 
   // Make new basicblock for loop header, insertin after current
@@ -272,22 +716,70 @@ Value *ForExprAST::codegen() {
   Value *StartVal = m_Start->codegen();
   if (!StartVal)
     return nullptr;
+  EmitLocation(*this);
   // Store the value into alloca
   Builder->CreateStore(StartVal, Alloca);
+  std::vector<IndexExprAST *> Hoisted;
+  Value *Last = nullptr;
+  if (!hoistBoundsChecks(StartVal, Hoisted, Last))
+    return nullptr;
+  // Once the whole range is checked, a loop starting at a whole number runs
+  // on an i64 counter up to Last, so the vectorizer gets an integer induction
+  // variable with a trip count. Start and Last are valid indices here, so the
+  // loop variable takes exactly the counter's values.
+  auto *StartC = dyn_cast<ConstantFP>(StartVal);
+  bool Counted = !Hoisted.empty() && StartC && !StartC->isNegative() &&
+                 StartC->getValueAPF().isInteger();
+  Value *LastIdx = Counted ? ArrayIndex(Last) : nullptr;
+  BasicBlock *PreheaderBB = Builder->GetInsertBlock();
 
   BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
   // explicit fall to current block to loop block
   Builder->CreateBr(LoopBB);
 
   Builder->SetInsertPoint(LoopBB);
+  PHINode *Counter = nullptr;
+  if (Counted) {
+    Counter = Builder->CreatePHI(Builder->getInt64Ty(), 2, m_VarName);
+    Counter->addIncoming(
+        Builder->getInt64(int64_t(StartC->getValueAPF().convertToDouble())),
+        PreheaderBB);
+    Builder->CreateStore(
+        Builder->CreateSIToFP(Counter, Builder->getDoubleTy()), Alloca);
+    for (IndexExprAST *Index : Hoisted)
+      Index->setElement(Counter);
+  }
 
   // withing the loop variable is defined equal to phi node
   // if it shadows an existing variable then restore it
   AllocaInst *OldVal = NamedValues[m_VarName];
   NamedValues[m_VarName] = Alloca;
   // emit body of the loop
-  if (!m_Body->codegen())
+  Value *BodyVal = m_Body->codegen();
+  for (IndexExprAST *Index : Hoisted)
+    Index->setElement(nullptr);
+  if (!BodyVal)
     return nullptr;
+
+  if (Counted) {
+    // the step is 1 and the end condition has no side effects, the loop ends
+    // after the body has run for Last
+    EmitLocation(*this);
+    Value *Next = Builder->CreateAdd(Counter, Builder->getInt64(1), "nextvar",
+                                     /*HasNUW=*/true, /*HasNSW=*/true);
+    Counter->addIncoming(Next, Builder->GetInsertBlock());
+    Value *EndCond = Builder->CreateICmpNE(Counter, LastIdx, "loopcond");
+    BasicBlock *AfterBB =
+        BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    Builder->SetInsertPoint(AfterBB);
+    if (OldVal)
+      NamedValues[m_VarName] = OldVal;
+    else
+      NamedValues.erase(m_VarName);
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  }
+
   // emit step value
   Value *StepVal = nullptr;
   if (m_Step) {
@@ -302,6 +794,7 @@ Value *ForExprAST::codegen() {
   Value *EndCond = m_End->codegen();
   if (!EndCond)
     return nullptr;
+  EmitLocation(*this);
 
   // add step value to looo variable
   // reload, increament and restore the alloca
@@ -334,13 +827,460 @@ void InitializeModuleAndManagers() {
   // open new context and module
   TheContext = std::make_unique<LLVMContext>();
   TheModule = std::make_unique<Module>("Kaleidoscope", *TheContext);
+  if (TheJIT)
+    TheModule->setDataLayout(TheJIT->getDataLayout());
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+  DBuilder.reset();
+  if (EmitDebugInfo) {
+    DBuilder = std::make_unique<DIBuilder>(*TheModule);
+    TheCU = DBuilder->createCompileUnit(
+        dwarf::DW_LANG_C,
+        DBuilder->createFile(sys::path::filename(DebugSourceFile),
+                             sys::path::parent_path(DebugSourceFile)),
+        "Kaleidoscope Compiler", /*isOptimized=*/true, "", 0, "",
+        DICompileUnit::LineTablesOnly);
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                             DEBUG_METADATA_VERSION);
+  }
+}
+
+// optimize the current module, hand it to the JIT and start a new one
+static void AddModuleToJIT(ResourceTrackerSP RT = nullptr) {
+  OptimizeModule(nullptr, false);
+  ExitOnErr(TheJIT->addModule(
+      ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT));
+  InitializeModuleAndManagers();
+}
+
+// Infer readnone, nounwind, willreturn and speculatable for every function
+// defined in the module. Declarations are taken at their word, so externs
+// are impure unless declared with `extern pure`.
+static void InferFunctionAttributes() {
+  std::vector<Function *> Defined;
+  std::map<Function *, std::vector<Function *>> Callees;
+  // start optimistic and knock functions out until nothing changes
+  std::set<Function *> Impure, MayUnwind;
+  for (Function &F : *TheModule) {
+    if (F.isDeclaration())
+      continue;
+    Defined.push_back(&F);
+    for (Instruction &I : instructions(F)) {
+      if (auto *CB = dyn_cast<CallBase>(&I)) {
+        if (Function *Callee = CB->getCalledFunction()) {
+          Callees[&F].push_back(Callee);
+        } else {
+          Impure.insert(&F);
+          MayUnwind.insert(&F);
+        }
+        continue;
+      }
+      // only the function's own stack slots may be touched
+      if (I.mayReadOrWriteMemory()) {
+        Value *Ptr = getLoadStorePointerOperand(&I);
+        if (!Ptr || !isa<AllocaInst>(getUnderlyingObject(Ptr)))
+          Impure.insert(&F);
+      }
+    }
+  }
+
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (Function *F : Defined) {
+      for (Function *Callee : Callees[F]) {
+        bool CalleePure = Callee->isDeclaration()
+                              ? Callee->doesNotAccessMemory()
+                              : !Impure.count(Callee);
+        bool CalleeNoUnwind = Callee->isDeclaration()
+                                  ? Callee->doesNotThrow()
+                                  : !MayUnwind.count(Callee);
+        if (!CalleePure && Impure.insert(F).second)
+          Changed = true;
+        if (!CalleeNoUnwind && MayUnwind.insert(F).second)
+          Changed = true;
+      }
+    }
+  }
+
+  // termination is proven bottom up instead: no loops, no recursion and only
+  // calls to functions that return
+  std::set<Function *> WillReturn, Speculatable;
+  std::set<Function *> HasLoops;
+  for (Function *F : Defined) {
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>> BackEdges;
+    FindFunctionBackedges(*F, BackEdges);
+    if (!BackEdges.empty())
+      HasLoops.insert(F);
+  }
+  Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (Function *F : Defined) {
+      if (HasLoops.count(F) || WillReturn.count(F))
+        continue;
+      bool AllReturn = true;
+      for (Function *Callee : Callees[F])
+        AllReturn &= Callee->isDeclaration()
+                         ? Callee->hasFnAttribute(Attribute::WillReturn)
+                         : WillReturn.count(Callee) != 0;
+      if (AllReturn) {
+        WillReturn.insert(F);
+        Changed = true;
+      }
+    }
+  }
+  Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (Function *F : Defined) {
+      if (Impure.count(F) || !WillReturn.count(F) || Speculatable.count(F))
+        continue;
+      bool AllSpeculatable = true;
+      for (Function *Callee : Callees[F])
+        AllSpeculatable &= Callee->isDeclaration()
+                               ? Callee->isSpeculatable()
+                               : Speculatable.count(Callee) != 0;
+      if (AllSpeculatable) {
+        Speculatable.insert(F);
+        Changed = true;
+      }
+    }
+  }
+
+  for (Function *F : Defined) {
+    F->removeFnAttr(Attribute::Memory);
+    F->removeFnAttr(Attribute::NoUnwind);
+    F->removeFnAttr(Attribute::WillReturn);
+    F->removeFnAttr(Attribute::Speculatable);
+    if (!Impure.count(F))
+      F->setDoesNotAccessMemory();
+    if (!MayUnwind.count(F))
+      F->setDoesNotThrow();
+    if (WillReturn.count(F))
+      F->addFnAttr(Attribute::WillReturn);
+    if (Speculatable.count(F))
+      F->addFnAttr(Attribute::Speculatable);
+  }
+}
+
+// Move the body of F into F.impl and turn F into a wrapper that looks the
+// arguments up in a cache before calling it. Recursive calls still go
+// through F, so they hit the cache as well.
+static void MemoizeFunction(Function &F) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *I8Ty = Type::getInt8Ty(*TheContext);
+  Type *I64Ty = Type::getInt64Ty(*TheContext);
+  unsigned NumArgs = F.arg_size();
+  uint64_t Size = llvm::bit_ceil(std::max(MemoCacheSize, 1u));
+
+  Function *Impl = Function::Create(F.getFunctionType(),
+                                    Function::InternalLinkage,
+                                    F.getName() + ".impl", TheModule.get());
+  Impl->copyAttributesFrom(&F);
+  Impl->removeFnAttr("kaleidoscope-memo");
+  Impl->setLinkage(Function::InternalLinkage);
+  Impl->splice(Impl->begin(), &F);
+  // the body's debug locations belong to its subprogram
+  Impl->setSubprogram(F.getSubprogram());
+  F.setSubprogram(nullptr);
+  for (unsigned i = 0; i != NumArgs; ++i) {
+    F.getArg(i)->replaceAllUsesWith(Impl->getArg(i));
+    Impl->getArg(i)->setName(F.getArg(i)->getName());
+  }
+  F.removeFnAttr("kaleidoscope-memo");
+
+  // entries are {used, argument bits, result}
+  StructType *EntryTy =
+      StructType::get(I8Ty, ArrayType::get(I64Ty, NumArgs), DoubleTy);
+  ArrayType *TableTy = ArrayType::get(EntryTy, Size);
+  auto *Table = new GlobalVariable(*TheModule, TableTy, false,
+                                   GlobalValue::PrivateLinkage,
+                                   Constant::getNullValue(TableTy),
+                                   F.getName() + ".memo");
+
+  BasicBlock *Entry = BasicBlock::Create(*TheContext, "entry", &F);
+  BasicBlock *Probe = BasicBlock::Create(*TheContext, "probe", &F);
+  BasicBlock *Check = BasicBlock::Create(*TheContext, "check", &F);
+  BasicBlock *Hit = BasicBlock::Create(*TheContext, "hit", &F);
+  BasicBlock *Next = BasicBlock::Create(*TheContext, "next", &F);
+  BasicBlock *Full = BasicBlock::Create(*TheContext, "full", &F);
+  BasicBlock *Miss = BasicBlock::Create(*TheContext, "miss", &F);
+  IRBuilder<> B(Entry);
+
+  // hash the bit patterns of the arguments
+  std::vector<Value *> Keys;
+  Value *Hash = B.getInt64(0xcbf29ce484222325ULL);
+  for (Argument &Arg : F.args()) {
+    Value *Key = B.CreateBitCast(&Arg, I64Ty);
+    Keys.push_back(Key);
+    Hash = B.CreateMul(B.CreateXor(Hash, Key),
+                       B.getInt64(0x9e3779b97f4a7c15ULL));
+    Hash = B.CreateXor(Hash, B.CreateLShr(Hash, 29));
+  }
+  Value *Mask = B.getInt64(Size - 1);
+  Value *Home = B.CreateAnd(Hash, Mask, "home");
+  B.CreateBr(Probe);
+
+  // linear probing, an empty slot ends the search
+  B.SetInsertPoint(Probe);
+  PHINode *Idx = B.CreatePHI(I64Ty, 2, "i");
+  Idx->addIncoming(B.getInt64(0), Entry);
+  Value *Slot = B.CreateAnd(B.CreateAdd(Home, Idx), Mask, "slot");
+  Value *UsedPtr = B.CreateInBoundsGEP(
+      TableTy, Table, {B.getInt64(0), Slot, B.getInt32(0)}, "usedptr");
+  Value *Used = B.CreateLoad(I8Ty, UsedPtr, "used");
+  B.CreateCondBr(B.CreateICmpEQ(Used, B.getInt8(0)), Miss, Check);
+
+  B.SetInsertPoint(Check);
+  Value *Match = B.getTrue();
+  for (unsigned i = 0; i != NumArgs; ++i) {
+    Value *KeyPtr = B.CreateInBoundsGEP(
+        TableTy, Table,
+        {B.getInt64(0), Slot, B.getInt32(1), B.getInt32(i)}, "keyptr");
+    Match = B.CreateAnd(Match, B.CreateICmpEQ(B.CreateLoad(I64Ty, KeyPtr),
+                                              Keys[i]));
+  }
+  B.CreateCondBr(Match, Hit, Next);
+
+  B.SetInsertPoint(Hit);
+  Value *ValPtr = B.CreateInBoundsGEP(
+      TableTy, Table, {B.getInt64(0), Slot, B.getInt32(2)}, "valptr");
+  B.CreateRet(B.CreateLoad(DoubleTy, ValPtr, "cached"));
+
+  B.SetInsertPoint(Next);
+  Value *NextIdx = B.CreateAdd(Idx, B.getInt64(1), "nexti");
+  Idx->addIncoming(NextIdx, Next);
+  B.CreateCondBr(B.CreateICmpULT(NextIdx, B.getInt64(MemoProbes)), Probe,
+                 Full);
+
+  std::vector<Value *> Args;
+  for (Argument &Arg : F.args())
+    Args.push_back(&Arg);
+
+  // every probed slot is taken, evict the home slot or skip caching
+  B.SetInsertPoint(Full);
+  if (MemoEvict) {
+    B.CreateBr(Miss);
+  } else {
+    B.CreateRet(B.CreateCall(Impl, Args, "uncached"));
+  }
+
+  B.SetInsertPoint(Miss);
+  PHINode *Dest = B.CreatePHI(I64Ty, 2, "dest");
+  Dest->addIncoming(Slot, Probe);
+  if (MemoEvict)
+    Dest->addIncoming(Home, Full);
+  Value *Result = B.CreateCall(Impl, Args, "result");
+  B.CreateStore(B.getInt8(1),
+                B.CreateInBoundsGEP(TableTy, Table,
+                                    {B.getInt64(0), Dest, B.getInt32(0)}));
+  for (unsigned i = 0; i != NumArgs; ++i)
+    B.CreateStore(Keys[i], B.CreateInBoundsGEP(TableTy, Table,
+                                               {B.getInt64(0), Dest,
+                                                B.getInt32(1), B.getInt32(i)}));
+  B.CreateStore(Result,
+                B.CreateInBoundsGEP(TableTy, Table,
+                                    {B.getInt64(0), Dest, B.getInt32(2)}));
+  B.CreateRet(Result);
+
+  verifyFunction(F, &llvm::errs());
+}
+
+static bool isSelfRecursive(Function &F) {
+  for (Instruction &I : instructions(F))
+    if (auto *CB = dyn_cast<CallBase>(&I))
+      if (CB->getCalledFunction() == &F)
+        return true;
+  return false;
+}
+
+// memoize `def memo` functions, and pure recursive ones under MemoizePure
+static bool MemoizeFunctions() {
+  std::vector<Function *> Worklist;
+  for (Function &F : *TheModule) {
+    if (F.isDeclaration())
+      continue;
+    if (F.hasFnAttribute("kaleidoscope-memo") ||
+        (MemoizePure && F.doesNotAccessMemory() && isSelfRecursive(F)))
+      Worklist.push_back(&F);
+  }
+  for (Function *F : Worklist)
+    MemoizeFunction(*F);
+  return !Worklist.empty();
+}
+
+// V passed through an empty asm statement as an in/out register operand, so
+// the optimizer can't see where the result comes from or where V goes
+static Value *EmitOpaque(IRBuilder<> &B, Value *V) {
+  Type *I64Ty = B.getInt64Ty();
+  FunctionType *FT = FunctionType::get(I64Ty, {I64Ty}, false);
+  Value *Out = B.CreateCall(FT, InlineAsm::get(FT, "", "=r,0", true),
+                            {B.CreateBitCast(V, I64Ty)});
+  return B.CreateBitCast(Out, V->getType());
+}
+
+// clockd(), rdtscd() or a call to a function that reads a timer and may be
+// inlined by the pipeline later
+static bool isTimerRead(const CallInst &CI,
+                        const std::set<Function *> &TimerFunctions) {
+  Function *Callee = CI.getCalledFunction();
+  return Callee && (Callee->getName() == "clockd" ||
+                    Callee->getIntrinsicID() == Intrinsic::readcyclecounter ||
+                    TimerFunctions.count(Callee));
+}
+
+// Calls that don't write memory and lie between two timer reads have their
+// arguments and result passed through EmitOpaque. The barriers around the
+// timer reads only order memory, so a call like fib(30) in bench/timing.kd
+// could otherwise be moved out of the timed region or deleted. Calls that
+// write memory are already ordered by the barriers.
+struct KeepTimedCallsPass : PassInfoMixin<KeepTimedCallsPass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    // functions reading a timer, directly or through one another
+    std::set<Function *> TimerFunctions;
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      for (Function &F : M) {
+        if (F.isDeclaration() || TimerFunctions.count(&F))
+          continue;
+        for (Instruction &I : instructions(F)) {
+          auto *CI = dyn_cast<CallInst>(&I);
+          if (CI && isTimerRead(*CI, TimerFunctions)) {
+            TimerFunctions.insert(&F);
+            Changed = true;
+            break;
+          }
+        }
+      }
+    }
+
+    bool Modified = false;
+    for (Function &F : M) {
+      if (!TimerFunctions.count(&F))
+        continue;
+      std::vector<CallInst *> Reads, Calls;
+      for (Instruction &I : instructions(F)) {
+        auto *CI = dyn_cast<CallInst>(&I);
+        if (!CI || CI->isInlineAsm())
+          continue;
+        if (isTimerRead(*CI, TimerFunctions))
+          Reads.push_back(CI);
+        else if (CI->getType()->isDoubleTy() && CI->onlyReadsMemory())
+          Calls.push_back(CI);
+      }
+
+      for (CallInst *CI : Calls) {
+        auto Reaches = [](Instruction *From, Instruction *To) {
+          return isPotentiallyReachable(From, To);
+        };
+        bool AfterRead = llvm::any_of(
+            Reads, [&](CallInst *R) { return Reaches(R, CI); });
+        bool BeforeRead = llvm::any_of(
+            Reads, [&](CallInst *R) { return Reaches(CI, R); });
+        if (!AfterRead || !BeforeRead)
+          continue;
+
+        IRBuilder<> B(CI);
+        for (Use &Arg : CI->args())
+          if (Arg->getType()->isDoubleTy())
+            Arg.set(EmitOpaque(B, Arg));
+        B.SetInsertPoint(CI->getNextNode());
+        auto *Result = cast<Instruction>(EmitOpaque(B, CI));
+        // the bitcast feeding the asm keeps using the call
+        Instruction *In = cast<Instruction>(
+            cast<CallInst>(Result->getOperand(0))->getArgOperand(0));
+        CI->replaceUsesWithIf(Result,
+                              [&](Use &U) { return U.getUser() != In; });
+        Modified = true;
+      }
+    }
+    return Modified ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+// run module level passes before the module is handed to the backend
+void OptimizeModule(TargetMachine *TM, bool WholeProgram) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  // nothing is generated into the module after this
+  if (DBuilder) {
+    DBuilder->finalize();
+    DBuilder.reset();
+  }
+
+  InferFunctionAttributes();
+  // the caches are memory writes, so callers of memoized functions lose
+  // their purity
+  if (MemoizeFunctions())
+    InferFunctionAttributes();
+
+  // registered before the defaults so it is the one the passes see
+  TargetLibraryInfoImpl TLII(Triple(TheModule->getTargetTriple()));
+  TLII.addVectorizableFunctionsFromVecLib(
+      VecLib, Triple(TheModule->getTargetTriple()));
+  FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+
+  PassBuilder PB(TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  // always inline user defined operators, even when nothing else is optimized
+  MPM.addPass(AlwaysInlinerPass());
+  // after inlining the operators, so `fib(30) : printd(clockd() - start)`
+  // has both timer reads and the call in one function, and before anything
+  // that could move or delete the call
+  MPM.addPass(KeepTimedCallsPass());
+
+  if (WholeProgram) {
+    // the driver links the final executable itself, so apart from main
+    // nothing defined here can be referenced from outside the module
+    for (Function &F : *TheModule)
+      if (!F.isDeclaration() && F.getName() != "main")
+        F.setLinkage(Function::InternalLinkage);
+
+    MPM.addPass(IPSCCPPass());
+    MPM.addPass(GlobalDCEPass());
+    MPM.addPass(PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2));
+  }
+  MPM.run(*TheModule, MAM);
 }
 
 // for top level parsing
 void HandleDefinition() {
   if (auto FnAST = ParseDefinition()) {
-    FnAST->codegen();
+    if (Interpret) {
+      InterpretDefinition(std::move(FnAST));
+      return;
+    }
+    if (UseVM) {
+      VMAddDefinition(std::move(FnAST));
+      return;
+    }
+    if (!TheJIT) {
+      FnAST->codegen();
+      return;
+    }
+
+    std::string Name = FnAST->getName();
+    auto Version = FunctionVersions.find(Name);
+    bool Redefined = Version != FunctionVersions.end();
+    if (Redefined)
+      ++Version->second;
+    if (FnAST->codegen()) {
+      FunctionVersions.try_emplace(Name, 0);
+      AddModuleToJIT();
+    } else if (Redefined) {
+      --Version->second;
+    }
   } else {
     getNextToken(); // for error recovery
   }
@@ -348,6 +1288,14 @@ void HandleDefinition() {
 
 void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
+    if (Interpret) {
+      InterpretExtern(std::move(ProtoAST));
+      return;
+    }
+    if (UseVM) {
+      VMAddExtern(std::move(ProtoAST));
+      return;
+    }
     ProtoAST->codegen();
     FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
   } else {
@@ -355,9 +1303,106 @@ void HandleExtern() {
   }
 }
 
+// close the function top level expressions are currently merged into
+void FinishTopLevelExprs() {
+  if (!TopLevelChunk)
+    return;
+
+  Builder->SetInsertPoint(TopLevelTail);
+  if (TopLevelChunk->getReturnType()->isIntegerTy())
+    Builder->CreateRet(Builder->getInt32(0));
+  else if (LastTopLevelValue)
+    Builder->CreateRet(LastTopLevelValue);
+  else
+    Builder->CreateRet(ConstantFP::get(*TheContext, APFloat(0.0)));
+  verifyFunction(*TopLevelChunk, &llvm::errs());
+
+  TopLevelChunk = nullptr;
+  TopLevelTail = nullptr;
+  LastTopLevelValue = nullptr;
+  TopLevelChunkExprs = 0;
+}
+
+static void MergeTopLevelExpr(ExprAST &Body) {
+  if (!TopLevelChunk) {
+    if (TopLevelChunkSize == 0) {
+      FunctionType *FT = FunctionType::get(Builder->getInt32Ty(), false);
+      TopLevelChunk = Function::Create(FT, Function::ExternalLinkage, "main",
+                                       TheModule.get());
+    } else {
+      static int counter = 0;
+      FunctionType *FT =
+          FunctionType::get(Type::getDoubleTy(*TheContext), false);
+      TopLevelChunk =
+          Function::Create(FT, Function::ExternalLinkage,
+                           "__anon_chunk" + std::to_string(counter++),
+                           TheModule.get());
+      TopLevelFunctions.push_back(TopLevelChunk);
+    }
+    TopLevelTail = BasicBlock::Create(*TheContext, "entry", TopLevelChunk);
+  }
+
+  // every expression starts in a fresh block so a failed one can be dropped
+  BasicBlock *ExprBB = BasicBlock::Create(*TheContext, "expr", TopLevelChunk);
+  Builder->SetInsertPoint(TopLevelTail);
+  Builder->CreateBr(ExprBB);
+  Builder->SetInsertPoint(ExprBB);
+
+  if (Value *V = Body.codegen()) {
+    LastTopLevelValue = V;
+    TopLevelTail = Builder->GetInsertBlock();
+    if (TopLevelChunkSize && ++TopLevelChunkExprs == TopLevelChunkSize)
+      FinishTopLevelExprs();
+    return;
+  }
+
+  // reading error, remove whatever the expression emitted
+  TopLevelTail->getTerminator()->eraseFromParent();
+  std::vector<BasicBlock *> Dead;
+  for (auto I = ExprBB->getIterator(), E = TopLevelChunk->end(); I != E; ++I)
+    Dead.push_back(&*I);
+  for (BasicBlock *BB : Dead)
+    BB->dropAllReferences();
+  for (BasicBlock *BB : Dead)
+    BB->eraseFromParent();
+}
+
+// compile an expression typed into the REPL into a module of its own, run it
+// and free the module again, so evaluations don't accumulate in the JIT
+static void EvaluateTopLevelExpr(FunctionAST &FnAST) {
+  std::string Name = FnAST.getName();
+  Function *F = FnAST.codegen();
+  FunctionProtos.erase(Name);
+  if (!F)
+    return;
+
+  ResourceTrackerSP RT = TheJIT->getMainJITDylib().createResourceTracker();
+  AddModuleToJIT(RT);
+  // a symbol that can't be resolved fails the lookup, report it and go back
+  // to the prompt
+  auto ExprSymbol = TheJIT->lookup(Name);
+  if (ExprSymbol) {
+    double Result = ExprSymbol->getAddress().toPtr<double (*)()>()();
+    flushd();
+    fprintf(stderr, "Evaluated to %f\n", Result);
+  } else {
+    logAllUnhandledErrors(ExprSymbol.takeError(), errs(), "Error: ");
+  }
+  if (Error Err = RT->remove())
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+}
+
 void HandleTopLevelExpr() {
   if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto *F = FnAST->codegen()) {
+    if (Interpret) {
+      InterpretTopLevelExpr(*FnAST);
+    } else if (UseVM) {
+      VMRunTopLevelExpr(*FnAST);
+    } else if (TheJIT) {
+      EvaluateTopLevelExpr(*FnAST);
+    } else if (MergeTopLevel) {
+      MergeTopLevelExpr(FnAST->getBody());
+    } else if (auto *F = FnAST->codegen()) {
       TopLevelFunctions.push_back(F);
     }
   } else {
@@ -373,6 +1418,7 @@ Value *UnaryExprAST::codegen() {
   Function *F = getFunction(std::string("unary") + m_Opcode);
   if (!F)
     return LogErrorV("Unknown unary operator", getLocation());
+  EmitLocation(*this);
   return Builder->CreateCall(F, OperandV, "unop");
 }
 
@@ -400,6 +1446,7 @@ Value *VarExprAST::codegen() {
       InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
     }
     AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    EmitLocation(*this);
     Builder->CreateStore(InitVal, Alloca);
 
     // remember the old bindings so that we can restore them
@@ -13,6 +13,9 @@ using namespace llvm;
 inline raw_ostream &Indent(raw_ostream &O, int size) {
   return O << std::string(size, ' ');
 }
+class IndexExprAST;
+class BytecodeBuilder;
+
 // Blueprint for AST
 class ExprAST {
   SourceLocation Loc;
@@ -21,9 +24,27 @@ public:
   ExprAST(SourceLocation Loc) : Loc(Loc) {}
   virtual ~ExprAST() = default;
   virtual Value *codegen() = 0;
+  // evaluates the expression without generating code, see interpreter.cpp
+  virtual double eval() = 0;
+  // compiles the expression into bytecode for the VM, returning the register
+  // that holds its value or -1 on an error, see vm.cpp
+  virtual int emitBytecode(BytecodeBuilder &B) = 0;
   int getLine() const { return Loc.Line; }
   int getCol() const { return Loc.Col; }
   SourceLocation getLocation() const { return Loc; }
+  // called on expressions whose value is returned straight out of the
+  // enclosing function
+  virtual void markTail() {}
+  // whether evaluating this may assign to or rebind the variable Name
+  virtual bool assigns(const std::string &Name) const { return false; }
+  // collects the array accesses that run whenever this expression does
+  virtual void collectIndexes(std::vector<IndexExprAST *> &Indexes) {}
+  // whether this has no side effects and the same value on every iteration
+  // of a loop with variable LoopVar and body Body
+  virtual bool isLoopInvariant(const ExprAST &Body,
+                               const std::string &LoopVar) const {
+    return false;
+  }
   virtual raw_ostream &dump(raw_ostream &out, int ind) {
     return out << ':' << getLine() << ':' << getCol() << '\n';
   }
@@ -36,11 +57,38 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(SourceLocation Loc, double Val) : ExprAST(Loc), m_Val(Val) {}
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  double getVal() const { return m_Val; }
+  bool isLoopInvariant(const ExprAST &Body,
+                       const std::string &LoopVar) const override {
+    return true;
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     return ExprAST::dump(out << m_Val, ind);
   }
 };
 
+// for string literals like "data.bin", their value is the bits of a pointer
+// to the nul terminated string
+class StringExprAST : public ExprAST {
+  std::string m_Val;
+
+public:
+  StringExprAST(SourceLocation Loc, const std::string &Val)
+      : ExprAST(Loc), m_Val(Val) {}
+  Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  bool isLoopInvariant(const ExprAST &Body,
+                       const std::string &LoopVar) const override {
+    return true;
+  }
+  raw_ostream &dump(raw_ostream &out, int ind) override {
+    return ExprAST::dump(out << '"' << m_Val << '"', ind);
+  }
+};
+
 // for refrencing a variable like "x"
 class VariableExprAST : public ExprAST {
   std::string m_Name;
@@ -49,12 +97,58 @@ public:
   VariableExprAST(SourceLocation Loc, const std::string &Name)
       : ExprAST(Loc), m_Name(Name) {}
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
   const std::string &getName() const { return m_Name; }
+  bool isLoopInvariant(const ExprAST &Body,
+                       const std::string &LoopVar) const override {
+    return m_Name != LoopVar && !Body.assigns(m_Name);
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     return ExprAST::dump(out << m_Name, ind);
   }
 };
 
+// for array elements like a[i], as a value or the target of an assignment
+class IndexExprAST : public ExprAST {
+  std::string m_Array;
+  std::unique_ptr<ExprAST> m_Index;
+  bool m_Checked = true;
+  // the element number as an integer, set while the enclosing loop counts
+  Value *m_Element = nullptr;
+
+public:
+  IndexExprAST(SourceLocation Loc, const std::string &Array,
+               std::unique_ptr<ExprAST> Index)
+      : ExprAST(Loc), m_Array(Array), m_Index(std::move(Index)) {}
+  Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  // emits the address of the element, bounds checking the index
+  Value *codegenAddress();
+  const std::string &getArray() const { return m_Array; }
+  ExprAST &getIndex() { return *m_Index; }
+  // the index was already checked for every value it can take
+  void setUnchecked() {
+    m_Checked = false;
+    m_Element = nullptr;
+  }
+  // Element is the i64 counter of the loop the index is the variable of
+  void setElement(Value *Element) { m_Element = Element; }
+  bool assigns(const std::string &Name) const override {
+    return m_Index->assigns(Name);
+  }
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    Indexes.push_back(this);
+    m_Index->collectIndexes(Indexes);
+  }
+  raw_ostream &dump(raw_ostream &out, int ind) override {
+    ExprAST::dump(out << m_Array << "[]", ind);
+    m_Index->dump(Indent(out, ind) << "Index:", ind + 1);
+    return out;
+  }
+};
+
 class UnaryExprAST : public ExprAST {
   char m_Opcode;
   std::unique_ptr<ExprAST> m_Operand;
@@ -65,6 +159,14 @@ public:
       : ExprAST(Loc), m_Opcode(Opcode), m_Operand(std::move(Operand)) {}
 
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  bool assigns(const std::string &Name) const override {
+    return m_Operand->assigns(Name);
+  }
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    m_Operand->collectIndexes(Indexes);
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "unary" << m_Opcode, ind);
     m_Operand->dump(out, ind + 1);
@@ -82,6 +184,29 @@ public:
                 std::unique_ptr<ExprAST> RHS)
       : ExprAST(Loc), m_Op(Op), m_LHS(std::move(LHS)), m_RHS(std::move(RHS)) {}
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  char getOp() const { return m_Op; }
+  ExprAST &getLHS() { return *m_LHS; }
+  ExprAST &getRHS() { return *m_RHS; }
+  bool assigns(const std::string &Name) const override {
+    auto *Var = dynamic_cast<VariableExprAST *>(m_LHS.get());
+    if (m_Op == '=' && Var && Var->getName() == Name)
+      return true;
+    return m_LHS->assigns(Name) || m_RHS->assigns(Name);
+  }
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    m_LHS->collectIndexes(Indexes);
+    m_RHS->collectIndexes(Indexes);
+  }
+  bool isLoopInvariant(const ExprAST &Body,
+                       const std::string &LoopVar) const override {
+    // user defined operators are calls that may have side effects
+    return (m_Op == '+' || m_Op == '-' || m_Op == '*' || m_Op == '/' ||
+            m_Op == '<') &&
+           m_LHS->isLoopInvariant(Body, LoopVar) &&
+           m_RHS->isLoopInvariant(Body, LoopVar);
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "binary" << m_Op, ind);
     m_LHS->dump(Indent(out, ind) << "LHS:", ind + 1);
@@ -94,12 +219,28 @@ public:
 class CallExprAST : public ExprAST {
   std::string m_Callee;
   std::vector<std::unique_ptr<ExprAST>> m_Args;
+  bool m_IsTail = false;
 
 public:
   CallExprAST(SourceLocation Loc, const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args)
       : ExprAST(Loc), m_Callee(Callee), m_Args(std::move(Args)) {}
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  void markTail() override { m_IsTail = true; }
+  bool assigns(const std::string &Name) const override {
+    for (const auto &Arg : m_Args)
+      if (Arg->assigns(Name))
+        return true;
+    return false;
+  }
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    for (const auto &Arg : m_Args)
+      Arg->collectIndexes(Indexes);
+  }
+  bool isLoopInvariant(const ExprAST &Body,
+                       const std::string &LoopVar) const override;
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "call " << m_Callee, ind);
     for (const auto &Arg : m_Args)
@@ -116,6 +257,8 @@ class PrototypeAST {
   std::vector<std::string> m_Args;
   bool m_IsOperator;
   unsigned m_Precedence;
+  bool m_IsPure = false;
+  bool m_IsMemo = false;
 
 public:
   PrototypeAST(const std::string &Name, std::vector<std::string> Args,
@@ -125,6 +268,14 @@ public:
 
   Function *codegen();
   const std::string &getName() const { return m_Name; }
+  const std::vector<std::string> &getArgs() const { return m_Args; }
+
+  // externs declared pure neither touch memory nor fail to return
+  void setPure() { m_IsPure = true; }
+  bool isPure() const { return m_IsPure; }
+  // definitions declared memo cache their results keyed by argument bits
+  void setMemo() { m_IsMemo = true; }
+  bool isMemo() const { return m_IsMemo; }
 
   bool isUnaryOp() const { return m_IsOperator && m_Args.size() == 1; }
   bool isBinaryOp() const { return m_IsOperator && m_Args.size() == 2; }
@@ -147,6 +298,9 @@ public:
               std::unique_ptr<ExprAST> Body)
       : m_Proto(std::move(Proto)), m_Body(std::move(Body)) {}
   Function *codegen();
+  const std::string &getName() const { return m_Proto->getName(); }
+  PrototypeAST &getProto() { return *m_Proto; }
+  ExprAST &getBody() { return *m_Body; }
 };
 
 class IfExprAST : public ExprAST {
@@ -159,6 +313,20 @@ public:
         m_Else(std::move(Else)) {}
 
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  void markTail() override {
+    m_Then->markTail();
+    m_Else->markTail();
+  }
+  bool assigns(const std::string &Name) const override {
+    return m_Cond->assigns(Name) || m_Then->assigns(Name) ||
+           m_Else->assigns(Name);
+  }
+  // only the condition is evaluated every time
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    m_Cond->collectIndexes(Indexes);
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "if", ind);
     m_Cond->dump(Indent(out, ind) << "Cond:", ind + 1);
@@ -182,6 +350,26 @@ public:
         m_Body(std::move(Body)) {}
 
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  // bounds checks array accesses in the body before the loop, returns false
+  // on a codegen error. The accesses are added to Hoisted and Last is set to
+  // the final value of the loop variable.
+  bool hoistBoundsChecks(Value *StartVal, std::vector<IndexExprAST *> &Hoisted,
+                         Value *&Last);
+  bool assigns(const std::string &Name) const override {
+    return Name == m_VarName || m_Start->assigns(Name) ||
+           m_End->assigns(Name) || (m_Step && m_Step->assigns(Name)) ||
+           m_Body->assigns(Name);
+  }
+  // the body runs at least once
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    m_Start->collectIndexes(Indexes);
+    m_Body->collectIndexes(Indexes);
+    if (m_Step)
+      m_Step->collectIndexes(Indexes);
+    m_End->collectIndexes(Indexes);
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "for", ind);
     m_Start->dump(Indent(out, ind) << "Cond:", ind + 1);
@@ -205,6 +393,22 @@ public:
   }
 
   Value *codegen() override;
+  double eval() override;
+  int emitBytecode(BytecodeBuilder &B) override;
+  void markTail() override { m_Body->markTail(); }
+  bool assigns(const std::string &Name) const override {
+    for (const auto &NamedVar : m_VarNames)
+      if (NamedVar.first == Name ||
+          (NamedVar.second && NamedVar.second->assigns(Name)))
+        return true;
+    return m_Body->assigns(Name);
+  }
+  void collectIndexes(std::vector<IndexExprAST *> &Indexes) override {
+    for (const auto &NamedVar : m_VarNames)
+      if (NamedVar.second)
+        NamedVar.second->collectIndexes(Indexes);
+    m_Body->collectIndexes(Indexes);
+  }
   raw_ostream &dump(raw_ostream &out, int ind) override {
     ExprAST::dump(out << "var", ind);
     for (const auto &NamedVar : m_VarNames)
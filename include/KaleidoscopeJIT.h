@@ -13,90 +13,740 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "objcache.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/Debugging/PerfSupportPlugin.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/MapperJITLinkMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/MemoryMapper.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderPerf.h"
+#include "llvm/ExecutionEngine/Orc/TaskDispatch.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 namespace llvm {
 namespace orc {
 
+// in-process mapper that keeps track of how much memory was reserved for JIT
+// code and data and how much of it objects actually use
+class CountingMemoryMapper : public InProcessMemoryMapper {
+public:
+  std::atomic<uint64_t> MappedBytes{0}, UsedBytes{0};
+
+  using InProcessMemoryMapper::InProcessMemoryMapper;
+
+  static Expected<std::unique_ptr<CountingMemoryMapper>> Create() {
+    auto PageSize = sys::Process::getPageSize();
+    if (!PageSize)
+      return PageSize.takeError();
+    return std::make_unique<CountingMemoryMapper>(*PageSize);
+  }
+
+  void reserve(size_t NumBytes, OnReservedFunction OnReserved) override {
+    MappedBytes += NumBytes;
+    InProcessMemoryMapper::reserve(NumBytes, std::move(OnReserved));
+  }
+
+  void initialize(AllocInfo &AI, OnInitializedFunction OnInitialized) override {
+    for (auto &Segment : AI.Segments)
+      UsedBytes += Segment.ContentSize + Segment.ZeroFillSize;
+    InProcessMemoryMapper::initialize(AI, std::move(OnInitialized));
+  }
+};
+
+// appends a line per JIT compiled function to /tmp/perf-<pid>.map, where
+// perf looks up the names of code it finds in anonymous memory
+class PerfMap {
+  std::mutex Mutex;
+  std::unique_ptr<raw_fd_ostream> OS;
+
+public:
+  explicit PerfMap(std::unique_ptr<raw_fd_ostream> OS) : OS(std::move(OS)) {}
+
+  static Expected<std::unique_ptr<PerfMap>> Create() {
+    std::string Path =
+        "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+    std::error_code EC;
+    auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Append);
+    if (EC)
+      return createFileError(Path, EC);
+    return std::make_unique<PerfMap>(std::move(OS));
+  }
+
+  void add(uint64_t Addr, uint64_t Size, StringRef Name) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    *OS << format("%llx %llx ", (unsigned long long)Addr,
+                  (unsigned long long)Size)
+        << Name << '\n';
+    // perf may read the map while the program is still running
+    OS->flush();
+  }
+};
+
+// adds the functions of every object RuntimeDyld loads to a PerfMap
+class PerfMapListener : public JITEventListener {
+  PerfMap &Map;
+
+public:
+  explicit PerfMapListener(PerfMap &Map) : Map(Map) {}
+
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    // the debug object has its sections at the addresses they were loaded at
+    object::OwningBinary<object::ObjectFile> DebugObj =
+        L.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+    for (const auto &[Sym, Size] :
+         object::computeSymbolSizes(*DebugObj.getBinary())) {
+      Expected<object::SymbolRef::Type> Type = Sym.getType();
+      if (!Type) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function || !Size)
+        continue;
+      Expected<StringRef> Name = Sym.getName();
+      Expected<uint64_t> Addr = Sym.getAddress();
+      if (Name && Addr)
+        Map.add(*Addr, Size, *Name);
+      consumeError(Name.takeError());
+      consumeError(Addr.takeError());
+    }
+  }
+};
+
+// adds the functions of every graph JITLink links to a PerfMap
+class PerfMapPlugin : public ObjectLinkingLayer::Plugin {
+  PerfMap &Map;
+
+public:
+  explicit PerfMapPlugin(PerfMap &Map) : Map(Map) {}
+
+  void modifyPassConfig(MaterializationResponsibility &MR,
+                        jitlink::LinkGraph &G,
+                        jitlink::PassConfiguration &Config) override {
+    // addresses are final once the graph has been fixed up
+    Config.PostFixupPasses.push_back([this](jitlink::LinkGraph &G) {
+      for (jitlink::Symbol *Sym : G.defined_symbols())
+        if (Sym->hasName() && Sym->isCallable() && Sym->getSize())
+          Map.add(Sym->getAddress().getValue(), Sym->getSize(),
+                  *Sym->getName());
+      return Error::success();
+    });
+  }
+
+  Error notifyFailed(MaterializationResponsibility &MR) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(JITDylib &JD, ResourceKey K) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(JITDylib &JD, ResourceKey DstKey,
+                                   ResourceKey SrcKey) override {}
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  // with JITLink, objects are allocated from slabs reserved through Mapper
+  CountingMemoryMapper *Mapper = nullptr;
+  // only when profiling, RuntimeDyld notifies its listeners until it is
+  // destroyed
+  std::unique_ptr<PerfMap> PerfMapFile;
+  std::unique_ptr<PerfMapListener> PerfListener;
+  std::unique_ptr<ObjectLayer> ObjLinkingLayer;
+  // objects from earlier runs, used instead of compiling a module again
+  std::unique_ptr<JITObjectCache> ObjCache;
   IRCompileLayer CompileLayer;
+  IRTransformLayer CountLayer;
+  // only in lazy mode, splits modules into functions compiled on first call
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
 
   JITDylib &MainJD;
 
+  // only when tiered, functions are first compiled at -O0 and called through
+  // stubs, which are pointed at an -O3 version compiled on TierUpThread once
+  // a function has been called TierUpThreshold times
+  unsigned TierUpThreshold;
+  JITTargetMachineBuilder TierUpJTMB;
+  std::unique_ptr<JITObjectCache> Tier0ObjCache;
+  std::unique_ptr<IRCompileLayer> Tier0CompileLayer;
+  std::unique_ptr<IRTransformLayer> Tier0Layer;
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  // tier 0 code finds the JIT to call back through this
+  KaleidoscopeJIT *Self = this;
+  unsigned TieredModules = 0;
+  // stubs of functions added since the last lookup, not yet pointing anywhere
+  std::vector<std::string> PendingStubs;
+  std::mutex TierMutex;
+  std::condition_variable TierUpReady;
+  // bitcode of the module each tiered function was defined in
+  StringMap<std::shared_ptr<const SmallVector<char, 0>>> TierSources;
+  StringSet<> TieredUp;
+  std::deque<std::string> TierUpQueue;
+  bool StopTierUp = false;
+  std::thread TierUpThread;
+
+  std::atomic<unsigned> DefinedFunctions{0}, CompiledFunctions{0};
+
+  static unsigned countFunctions(const Module &M) {
+    unsigned Count = 0;
+    for (const Function &F : M)
+      if (!F.isDeclaration())
+        Count++;
+    return Count;
+  }
+
+  // reserve this much address space at a time when linking with JITLink, so
+  // code from many modules ends up on the same pages
+  static const size_t SlabSize = 1 << 20;
+
+  std::unique_ptr<ObjectLayer> createObjectLayer(const Triple &TT,
+                                                 bool UseJITLink) {
+    if (UseJITLink) {
+      auto CountingMapper = cantFail(CountingMemoryMapper::Create());
+      Mapper = CountingMapper.get();
+      return std::make_unique<ObjectLinkingLayer>(
+          *ES, std::make_unique<MapperJITLinkMemoryManager>(
+                   SlabSize, std::move(CountingMapper)));
+    }
+
+    auto RTDyldLayer = std::make_unique<RTDyldObjectLinkingLayer>(
+        *ES, []() { return std::make_unique<SectionMemoryManager>(); });
+    if (TT.isOSBinFormatCOFF()) {
+      RTDyldLayer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+      RTDyldLayer->setAutoClaimResponsibilityForObjectSymbols(true);
+    }
+    return RTDyldLayer;
+  }
+
+  // the objects a compiler emits depend on its target and options, and
+  // objects linked by JITLink are position independent
+  static std::unique_ptr<JITObjectCache>
+  createObjectCache(ObjectFileCache *Cache, const JITTargetMachineBuilder &JTMB,
+                    StringRef OptLevel, bool UseJITLink) {
+    if (!Cache)
+      return nullptr;
+    return std::make_unique<JITObjectCache>(
+        *Cache,
+        JTMB.getTargetTriple().str() + "/" + JTMB.getCPU() + "/" +
+            OptLevel.str() + (UseJITLink ? "/pic" : "/static"),
+        JTMB.getFeatures().getString());
+  }
+
+  IRTransformLayer::TransformFunction countCompiled() {
+    return [this](ThreadSafeModule TSM, MaterializationResponsibility &R) {
+      TSM.withModuleDo(
+          [this](Module &M) { CompiledFunctions += countFunctions(M); });
+      return std::move(TSM);
+    };
+  }
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  bool UseJITLink = false, ObjectFileCache *Cache = nullptr,
+                  unsigned TierUpThreshold = 0)
+      : ES(std::move(ES)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL),
+        ObjLinkingLayer(createObjectLayer(JTMB.getTargetTriple(), UseJITLink)),
+        ObjCache(createObjectCache(Cache, JTMB, "O2", UseJITLink)),
+        CompileLayer(*this->ES, *ObjLinkingLayer,
+                     std::make_unique<ConcurrentIRCompiler>(
+                         JTMB, this->ObjCache.get())),
+        CountLayer(*this->ES, CompileLayer, countCompiled()),
+        MainJD(this->ES->createBareJITDylib("<main>")),
+        TierUpThreshold(TierUpThreshold), TierUpJTMB(JTMB) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
-      ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-      ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+    if (this->EPCIU)
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, CountLayer, this->EPCIU->getLazyCallThroughManager(),
+          [this] { return this->EPCIU->createIndirectStubsManager(); });
+
+    if (TierUpThreshold) {
+      // fast instruction selection and no IR optimization for tier 0
+      JTMB.setCodeGenOptLevel(CodeGenOptLevel::None);
+      Tier0ObjCache = createObjectCache(Cache, JTMB, "O0", UseJITLink);
+      Tier0CompileLayer = std::make_unique<IRCompileLayer>(
+          *this->ES, *ObjLinkingLayer,
+          std::make_unique<ConcurrentIRCompiler>(JTMB, Tier0ObjCache.get()));
+      Tier0Layer = std::make_unique<IRTransformLayer>(
+          *this->ES, *Tier0CompileLayer, countCompiled());
+      Stubs = createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())();
+      cantFail(MainJD.define(absoluteSymbols(
+          {{Mangle("__kd_tierup"),
+            {ExecutorAddr::fromPtr(&tierUpCallback),
+             JITSymbolFlags::Exported | JITSymbolFlags::Callable}},
+           {Mangle("__kd_jit"),
+            {ExecutorAddr::fromPtr(&Self), JITSymbolFlags::Exported}}})));
+      TierUpThread = std::thread([this] { tierUpLoop(); });
     }
   }
 
   ~KaleidoscopeJIT() {
+    if (TierUpThread.joinable()) {
+      {
+        std::lock_guard<std::mutex> Lock(TierMutex);
+        StopTierUp = true;
+      }
+      TierUpReady.notify_one();
+      TierUpThread.join();
+    }
+    if (EPCIU)
+      if (auto Err = EPCIU->cleanup())
+        ES->reportError(std::move(Err));
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  // with Lazy each function is only compiled when it is first called. With
+  // more than one thread, modules and lazily compiled functions are compiled
+  // on a pool of up to Threads threads instead of the thread asking for them.
+  // UseJITLink links objects with JITLink into slab allocated memory instead
+  // of with RuntimeDyld into separate mappings per object. Given a Cache,
+  // objects are stored in it and modules compiled before are loaded from it.
+  // A TierUpThreshold other than 0 compiles functions quickly first and
+  // optimizes those called that many times in the background.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(bool Lazy = false, unsigned Threads = 1, bool UseJITLink = false,
+         ObjectFileCache *Cache = nullptr, unsigned TierUpThreshold = 0) {
+    std::unique_ptr<TaskDispatcher> Dispatcher;
+    if (Threads > 1)
+      Dispatcher = std::make_unique<DynamicThreadPoolTaskDispatcher>(Threads);
+    auto EPC = SelfExecutorProcessControl::Create(nullptr,
+                                                  std::move(Dispatcher));
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
+    std::unique_ptr<EPCIndirectionUtils> EPCIU;
+    if (Lazy) {
+      auto EPCIUOrErr = EPCIndirectionUtils::Create(*ES);
+      if (!EPCIUOrErr)
+        return EPCIUOrErr.takeError();
+      EPCIU = std::move(*EPCIUOrErr);
+      EPCIU->createLazyCallThroughManager(
+          *ES, ExecutorAddr::fromPtr(&handleLazyCallThroughError));
+      if (auto Err = setUpInProcessLCTMReentryViaEPCIU(*EPCIU))
+        return std::move(Err);
+    }
+
     JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
+    if (UseJITLink) {
+      JTMB.setRelocationModel(Reloc::PIC_);
+      JTMB.setCodeModel(CodeModel::Small);
+    }
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    return std::make_unique<KaleidoscopeJIT>(
+        std::move(ES), std::move(EPCIU), std::move(JTMB), std::move(*DL),
+        UseJITLink, Cache, TierUpThreshold);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // functions added to the JIT, and how many of them have been compiled
+  unsigned getDefinedFunctions() const { return DefinedFunctions; }
+  unsigned getCompiledFunctions() const { return CompiledFunctions; }
+  // memory reserved for JIT'd objects and the part of it in use, only
+  // tracked with JITLink
+  bool tracksMemory() const { return Mapper; }
+  uint64_t getMappedBytes() const { return Mapper ? Mapper->MappedBytes : 0; }
+  uint64_t getUsedBytes() const { return Mapper ? Mapper->UsedBytes : 0; }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+    TSM.withModuleDo(
+        [this](Module &M) { DefinedFunctions += countFunctions(M); });
+    if (CODLayer)
+      return CODLayer->add(RT, std::move(TSM));
+    if (!Tier0Layer)
+      return CountLayer.add(RT, std::move(TSM));
+    // code added with its own tracker is run once and removed again, so it
+    // isn't worth counting calls to
+    if (RT != MainJD.getDefaultResourceTracker())
+      return Tier0Layer->add(RT, std::move(TSM));
+    return addTiered(std::move(TSM));
+  }
+
+  // With WritePerfMap every function linked from now on is listed in
+  // /tmp/perf-<pid>.map for perf. WriteJITDump writes the jitdump records
+  // `perf inject --jit` turns into symbols and, for code compiled with debug
+  // info, source lines. With RuntimeDyld, objects are then also registered
+  // with debuggers through the GDB JIT interface.
+  Error enableProfiling(bool WritePerfMap, bool WriteJITDump) {
+    if (WritePerfMap) {
+      auto Map = PerfMap::Create();
+      if (!Map)
+        return Map.takeError();
+      PerfMapFile = std::move(*Map);
+    }
+
+    if (auto *LinkLayer = dyn_cast<ObjectLinkingLayer>(ObjLinkingLayer.get())) {
+      if (PerfMapFile)
+        LinkLayer->addPlugin(std::make_unique<PerfMapPlugin>(*PerfMapFile));
+      if (!WriteJITDump)
+        return Error::success();
+      // the plugin writes the records by calling into the executor, which
+      // is this process
+      auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+      if (auto Err = MainJD.define(absoluteSymbols(
+              {{ES->intern("llvm_orc_registerJITLoaderPerfStart"),
+                {ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfStart),
+                 Flags}},
+               {ES->intern("llvm_orc_registerJITLoaderPerfEnd"),
+                {ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfEnd),
+                 Flags}},
+               {ES->intern("llvm_orc_registerJITLoaderPerfImpl"),
+                {ExecutorAddr::fromPtr(&llvm_orc_registerJITLoaderPerfImpl),
+                 Flags}}})))
+        return Err;
+      auto Perf = PerfSupportPlugin::Create(ES->getExecutorProcessControl(),
+                                            MainJD, /*EmitDebugInfo=*/true,
+                                            /*EmitUnwindInfo=*/true);
+      if (!Perf)
+        return Perf.takeError();
+      LinkLayer->addPlugin(std::move(*Perf));
+      return Error::success();
+    }
+
+    auto &RTDyldLayer = cast<RTDyldObjectLinkingLayer>(*ObjLinkingLayer);
+    if (PerfMapFile) {
+      PerfListener = std::make_unique<PerfMapListener>(*PerfMapFile);
+      RTDyldLayer.registerJITEventListener(*PerfListener);
+    }
+    if (WriteJITDump) {
+      JITEventListener *Perf = JITEventListener::createPerfJITEventListener();
+      if (!Perf)
+        return createStringError(inconvertibleErrorCode(),
+                                 "LLVM was built without jitdump support "
+                                 "for RuntimeDyld, try --jitlink");
+      RTDyldLayer.registerJITEventListener(*Perf);
+      RTDyldLayer.registerJITEventListener(
+          *JITEventListener::createGDBRegistrationListener());
+    }
+    return Error::success();
+  }
+
+  // makes Name resolve to Addr without searching the process for it
+  Error defineAbsolute(StringRef Name, ExecutorAddr Addr) {
+    return MainJD.define(absoluteSymbols(
+        {{Mangle(Name.str()),
+          {Addr, JITSymbolFlags::Exported | JITSymbolFlags::Callable}}}));
   }
 
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
+    if (auto Err = resolveStubs())
+      return std::move(Err);
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  // how often each tiered function was called before it was recompiled, or
+  // so far if it wasn't, most called first. Prints nothing unless tiered.
+  void printTierStats(raw_ostream &OS) {
+    if (!TierUpThreshold)
+      return;
+    std::vector<std::pair<std::string, bool>> Functions;
+    {
+      std::lock_guard<std::mutex> Lock(TierMutex);
+      for (auto &Source : TierSources)
+        Functions.push_back(
+            {Source.first().str(), TieredUp.contains(Source.first())});
+    }
+    std::vector<std::pair<uint64_t, size_t>> Calls;
+    for (size_t I = 0; I < Functions.size(); I++) {
+      auto Counter =
+          ES->lookup({&MainJD}, Mangle(Functions[I].first + "$calls"));
+      if (!Counter) {
+        consumeError(Counter.takeError());
+        continue;
+      }
+      Calls.push_back({*Counter->getAddress().toPtr<uint64_t *>(), I});
+    }
+    std::sort(Calls.rbegin(), Calls.rend());
+
+    unsigned NumTieredUp = 0;
+    for (auto &F : Functions)
+      NumTieredUp += F.second;
+    OS << "tier 0 functions: " << Functions.size() << ", recompiled at O3: "
+       << NumTieredUp << " (threshold " << TierUpThreshold << " calls)\n";
+    for (auto &[Count, I] : Calls) {
+      if (!Count)
+        break;
+      OS << format("%12llu calls  ", (unsigned long long)Count)
+         << (Functions[I].second ? "O3  " : "O0  ") << Functions[I].first
+         << '\n';
+    }
+  }
+
+private:
+  // give everything local to M an external name of its own, so a function
+  // recompiled on its own can still refer to it
+  void promoteLocals(Module &M) {
+    std::string Prefix = "__kd" + std::to_string(TieredModules++) + ".";
+    for (GlobalValue &GV : M.global_values())
+      if (GV.hasLocalLinkage()) {
+        GV.setName(Prefix + GV.getName());
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+      }
+  }
+
+  // rename every function defined in M to its tier 0 body, make calls go
+  // through the stub with the original name, and count calls on entry
+  void instrumentTier0(Module &M) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Type *PtrTy = PointerType::getUnqual(Ctx);
+    FunctionCallee TierUp = M.getOrInsertFunction(
+        "__kd_tierup", Type::getVoidTy(Ctx), PtrTy, PtrTy);
+    GlobalVariable *JIT =
+        new GlobalVariable(M, PtrTy, /*isConstant=*/true,
+                           GlobalValue::ExternalLinkage, nullptr, "__kd_jit");
+
+    std::vector<Function *> Bodies;
+    for (Function &F : M)
+      if (!F.isDeclaration())
+        Bodies.push_back(&F);
+    for (Function *F : Bodies) {
+      std::string Name = F->getName().str();
+      F->setName(Name + "$t0");
+      Function *Stub = Function::Create(F->getFunctionType(),
+                                        Function::ExternalLinkage, Name, M);
+      Stub->setAttributes(F->getAttributes());
+      F->replaceAllUsesWith(Stub);
+      // the counter is a memory write, so the body is no longer pure
+      F->removeFnAttr(Attribute::Memory);
+
+      auto *Counter = new GlobalVariable(M, Int64Ty, /*isConstant=*/false,
+                                         GlobalValue::ExternalLinkage,
+                                         ConstantInt::get(Int64Ty, 0),
+                                         Name + "$calls");
+      BasicBlock &Entry = F->getEntryBlock();
+      IRBuilder<> B(&Entry, Entry.getFirstNonPHIOrDbgOrAlloca());
+      Value *Count = B.CreateAdd(B.CreateLoad(Int64Ty, Counter),
+                                 ConstantInt::get(Int64Ty, 1));
+      B.CreateStore(Count, Counter);
+      Value *Hot =
+          B.CreateICmpEQ(Count, ConstantInt::get(Int64Ty, TierUpThreshold));
+      Instruction *Then = SplitBlockAndInsertIfThen(
+          Hot, &*B.GetInsertPoint(), /*Unreachable=*/false,
+          MDBuilder(Ctx).createUnlikelyBranchWeights());
+      B.SetInsertPoint(Then);
+      B.CreateCall(TierUp, {B.CreateLoad(PtrTy, JIT),
+                            B.CreateGlobalString(Name, Name + "$name")});
+    }
+  }
+
+  Error addTiered(ThreadSafeModule TSM) {
+    std::vector<std::string> Names;
+    auto Source = std::make_shared<SmallVector<char, 0>>();
+    TSM.withModuleDo([&](Module &M) {
+      promoteLocals(M);
+      for (Function &F : M)
+        if (!F.isDeclaration())
+          Names.push_back(F.getName().str());
+      raw_svector_ostream OS(*Source);
+      WriteBitcodeToFile(M, OS);
+      instrumentTier0(M);
+    });
+
+    // stubs are defined before the bodies are linked, since the bodies call
+    // each other through them
+    IndirectStubsManager::StubInitsMap Inits;
+    for (auto &Name : Names)
+      Inits[Name] = {ExecutorAddr(),
+                     JITSymbolFlags::Exported | JITSymbolFlags::Callable};
+    if (auto Err = Stubs->createStubs(Inits))
+      return Err;
+    SymbolMap StubSymbols;
+    for (auto &Name : Names)
+      StubSymbols[Mangle(Name)] = Stubs->findStub(Name, false);
+    if (auto Err = MainJD.define(absoluteSymbols(std::move(StubSymbols))))
+      return Err;
+
+    {
+      std::lock_guard<std::mutex> Lock(TierMutex);
+      for (auto &Name : Names)
+        TierSources[Name] = Source;
+    }
+    PendingStubs.insert(PendingStubs.end(), Names.begin(), Names.end());
+    return Tier0Layer->add(MainJD, std::move(TSM));
+  }
+
+  // compile the tier 0 bodies added since the last lookup, all in one go so
+  // they can be compiled in parallel, and point their stubs at them
+  Error resolveStubs() {
+    if (PendingStubs.empty())
+      return Error::success();
+    std::vector<std::string> Names = std::move(PendingStubs);
+    PendingStubs.clear();
+    SymbolLookupSet Bodies;
+    for (auto &Name : Names)
+      Bodies.add(Mangle(Name + "$t0"));
+    auto Symbols = ES->lookup(makeJITDylibSearchOrder({&MainJD}),
+                              std::move(Bodies));
+    if (Symbols) {
+      for (auto &Name : Names)
+        if (auto Err = Stubs->updatePointer(
+                Name, (*Symbols)[Mangle(Name + "$t0")].getAddress()))
+          return Err;
+      return Error::success();
+    }
+
+    // Some body failed to link. Report it once, then resolve the bodies one
+    // by one so those that did link still get their stubs. The functions
+    // that failed are removed, so code calling them fails to link instead of
+    // jumping through a null stub, and later lookups go ahead.
+    ES->reportError(Symbols.takeError());
+    for (auto &Name : Names) {
+      auto Body = ES->lookup({&MainJD}, Mangle(Name + "$t0"));
+      if (Body) {
+        if (auto Err = Stubs->updatePointer(Name, Body->getAddress()))
+          return Err;
+        continue;
+      }
+      consumeError(Body.takeError());
+      if (auto Err = MainJD.remove({Mangle(Name)}))
+        ES->reportError(std::move(Err));
+      std::lock_guard<std::mutex> Lock(TierMutex);
+      TierSources.erase(Name);
+    }
+    return Error::success();
+  }
+
+  // called by tier 0 code the moment a function becomes hot
+  static void tierUpCallback(KaleidoscopeJIT *JIT, const char *Name) {
+    {
+      std::lock_guard<std::mutex> Lock(JIT->TierMutex);
+      JIT->TierUpQueue.push_back(Name);
+    }
+    JIT->TierUpReady.notify_one();
+  }
+
+  void tierUpLoop() {
+    std::unique_lock<std::mutex> Lock(TierMutex);
+    while (true) {
+      TierUpReady.wait(Lock,
+                       [this] { return StopTierUp || !TierUpQueue.empty(); });
+      if (StopTierUp)
+        return;
+      std::string Name = std::move(TierUpQueue.front());
+      TierUpQueue.pop_front();
+      auto Source = TierSources.lookup(Name);
+      Lock.unlock();
+      Error Err = tierUp(Name, *Source);
+      Lock.lock();
+      if (Err)
+        ES->reportError(std::move(Err));
+      else
+        TieredUp.insert(Name);
+    }
+  }
+
+  // compile Name again at -O3 from the module it was defined in and point its
+  // stub at the result. Everything else in the module stays available for
+  // inlining but is still called through its own stub.
+  Error tierUp(StringRef Name, const SmallVector<char, 0> &Source) {
+    auto Context = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Source.data(), Source.size()), Name),
+        *Context);
+    if (!M)
+      return M.takeError();
+    for (GlobalVariable &GV : (*M)->globals()) {
+      if (GV.isDeclaration())
+        continue;
+      if (GV.isConstant())
+        GV.setLinkage(GlobalValue::AvailableExternallyLinkage);
+      else
+        GV.setInitializer(nullptr);
+    }
+    for (Function &F : **M)
+      if (!F.isDeclaration() && F.getName() != Name)
+        F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    (*M)->getFunction(Name)->setName(Name + "$t3");
+
+    auto TM = TierUpJTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(TM->get());
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3).run(**M, MAM);
+
+    if (auto Err = CompileLayer.add(
+            MainJD, ThreadSafeModule(std::move(*M), std::move(Context))))
+      return Err;
+    auto Body = ES->lookup({&MainJD}, Mangle((Name + "$t3").str()));
+    if (!Body)
+      return Body.takeError();
+    return Stubs->updatePointer(Name, Body->getAddress());
+  }
 };
 
 } // end namespace orc
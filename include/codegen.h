@@ -1,18 +1,34 @@
 #pragma once
+#include "KaleidoscopeJIT.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
 #include <memory>
+#include <string>
 
 void InitializeModuleAndManagers();
+void OptimizeModule(llvm::TargetMachine *TM, bool WholeProgram);
 void HandleDefinition();
 void HandleExtern();
 void HandleTopLevelExpr();
+void FinishTopLevelExprs();
 
 extern llvm::ExitOnError ExitOnErr;
-/* extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT; */
+extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
 extern std::unique_ptr<llvm::Module> TheModule;
 extern std::unique_ptr<llvm::LLVMContext> TheContext;
 extern std::vector<llvm::Function *> TopLevelFunctions;
+extern bool Interpret;
+extern bool UseVM;
+extern bool MergeTopLevel;
+extern unsigned TopLevelChunkSize;
+extern bool MemoizePure;
+extern unsigned MemoCacheSize;
+extern bool MemoEvict;
+extern llvm::TargetLibraryInfoImpl::VectorLibrary VecLib;
+extern bool EmitDebugInfo;
+extern std::string DebugSourceFile;
 extern std::unique_ptr<llvm::IRBuilder<>> Builder;
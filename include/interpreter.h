@@ -0,0 +1,25 @@
+#pragma once
+#include "AST.h"
+#include <memory>
+#include <string>
+
+// With --interpret the top level handlers in codegen.cpp hand definitions,
+// externs and expressions to these instead of generating code for them.
+void InterpretDefinition(std::unique_ptr<FunctionAST> F);
+void InterpretExtern(std::unique_ptr<PrototypeAST> P);
+// evaluates a top level expression right away
+void InterpretTopLevelExpr(FunctionAST &F);
+
+// shared with the bytecode VM in vm.cpp
+
+// prints an error at Loc and exits, for errors found while running
+[[noreturn]] void RuntimeError(const char *Str, SourceLocation Loc);
+// the runtime is linked into the compiler, anything else an extern names is
+// looked up in the process, which includes libm. Null if it isn't found.
+void *findNative(const std::string &Name);
+// calls the native function Fn of NumArgs doubles
+double callNative(void *Fn, const double *Args, unsigned NumArgs,
+                  SourceLocation Loc);
+// an if or loop end condition holds when it is ordered and not 0, like the
+// fcmp one that codegen emits
+inline bool isTrue(double V) { return V < 0 || V > 0; }
@@ -28,7 +28,17 @@ enum TokenType {
   tok_unary = -12,
 
   // for local variables
-  tok_var = -13
+  tok_var = -13,
+
+  // function annotations
+  tok_pure = -14,
+  tok_memo = -15,
+
+  // string literals, only used for paths
+  tok_string = -16,
+
+  // input the lexer can't make a token of, StrVal says why
+  tok_error = -17
 };
 
 struct Token {
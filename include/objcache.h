@@ -0,0 +1,70 @@
+#pragma once
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// ObjectFileCache - content addressed on-disk store of compiled objects.
+/// Entries are named llvmcache-<key> so the directory can be size bounded
+/// with llvm::pruneCache.
+class ObjectFileCache {
+  std::string m_Dir;
+  uint64_t m_MaxBytes;
+
+public:
+  // the JIT looks objects up from several compile threads
+  std::atomic<unsigned> Hits = 0;
+  std::atomic<unsigned> Misses = 0;
+
+  ObjectFileCache(std::string Dir, uint64_t MaxBytes);
+
+  // key for M compiled for the given cpu and features
+  static std::string computeKey(const llvm::Module &M, llvm::StringRef CPU,
+                                llvm::StringRef Features);
+
+  std::string getPath(llvm::StringRef Key) const;
+  bool contains(llvm::StringRef Key);
+  std::unique_ptr<llvm::MemoryBuffer> lookup(llvm::StringRef Key);
+  bool store(llvm::StringRef Key, llvm::StringRef Object);
+  // drop least recently used entries until the cache fits in MaxBytes
+  void prune();
+};
+
+/// JITObjectCache - lets the JIT reuse objects from an ObjectFileCache, so a
+/// module compiled by an earlier process is loaded instead of codegen'd.
+/// Modules may be compiled on several threads at once.
+class JITObjectCache : public llvm::ObjectCache {
+  ObjectFileCache &m_Cache;
+  // what the objects are compiled for, JIT modules carry no triple
+  std::string m_Target;
+  std::string m_Features;
+  std::mutex m_Mutex;
+  // keys of modules that missed, until their object has been stored
+  llvm::DenseMap<const llvm::Module *, std::string> m_Pending;
+
+public:
+  // Target names the triple, cpu and anything else the compiler is set up
+  // with that changes the objects it emits
+  JITObjectCache(ObjectFileCache &Cache, llvm::StringRef Target,
+                 llvm::StringRef Features);
+
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *M) override;
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override;
+};
+
+// Emit M as one object per function plus one for its global variables,
+// reusing objects already in Cache. Paths of the objects to link are
+// appended to Objects.
+bool emitCachedObjects(llvm::Module &M, llvm::TargetMachine &TM,
+                       ObjectFileCache &Cache,
+                       std::vector<std::string> &Objects);
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// functions of the kdrt runtime that compiled programs call. The runtime is
+// also linked into the compiler so --run can hand them to the JIT directly.
+extern "C" {
+double putchard(double X);
+double printd(double X);
+double flushd();
+double clockd();
+double rdtscd();
+double kdbench(double (*F)(), double Iters);
+double *kdarray_new(double N);
+void kdarray_oob(int64_t Index, int64_t Len, int32_t Line);
+double *kdarray_map(const char *Path);
+}
+
+// Arrays are handled as doubles holding the bits of a pointer to their first
+// element, with the length in the 8 bytes before it. These are for the
+// interpreter and the VM, compiled code does the same inline.
+inline double *kdarray_pointer(double Handle) {
+  uint64_t Bits;
+  std::memcpy(&Bits, &Handle, sizeof(Bits));
+  return reinterpret_cast<double *>(Bits);
+}
+
+inline double kdarray_handle(const void *Array) {
+  uint64_t Bits = reinterpret_cast<uint64_t>(Array);
+  double Handle;
+  std::memcpy(&Handle, &Bits, sizeof(Handle));
+  return Handle;
+}
+
+inline int64_t kdarray_length(const double *Array) {
+  return reinterpret_cast<const int64_t *>(Array)[-1];
+}
+
+// array(n), len(a) and the mapped file functions mapfile(path), maplen(h)
+// and loadd(h, i) are built in unless the program defines its own, which
+// IsDefined tells. Shared by codegen, the interpreter and the VM.
+inline bool kdarray_builtin(const std::string &Name, unsigned NumArgs,
+                            bool (*IsDefined)(const std::string &Name)) {
+  static const struct {
+    const char *Name;
+    unsigned NumArgs;
+  } Builtins[] = {
+      {"array", 1}, {"len", 1}, {"mapfile", 1}, {"maplen", 1}, {"loadd", 2}};
+  for (auto &B : Builtins)
+    if (Name == B.Name)
+      return B.NumArgs == NumArgs && !IsDefined(Name);
+  return false;
+}
+
+// element number for a double index, fractions are dropped and values out
+// of range saturate like fptosi.sat, so they fail the bounds check. NaN is
+// INT64_MIN as in compiled code.
+inline int64_t kdarray_index(double Index) {
+  if (Index != Index || Index < -0x1p63)
+    return INT64_MIN;
+  if (Index >= 0x1p63)
+    return INT64_MAX;
+  return static_cast<int64_t>(Index);
+}
+
+// the element of the array Handle at Index, reporting an index out of
+// bounds with the given line
+inline double *kdarray_element(double Handle, double Index, int32_t Line) {
+  double *Array = kdarray_pointer(Handle);
+  int64_t Idx = kdarray_index(Index);
+  int64_t Len = kdarray_length(Array);
+  if (uint64_t(Idx) >= uint64_t(Len))
+    kdarray_oob(Idx, Len, Line);
+  return Array + Idx;
+}
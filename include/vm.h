@@ -0,0 +1,10 @@
+#pragma once
+#include "AST.h"
+#include <memory>
+
+// With --vm the top level handlers in codegen.cpp hand definitions, externs
+// and expressions to these, which compile them to bytecode for the VM.
+void VMAddDefinition(std::unique_ptr<FunctionAST> F);
+void VMAddExtern(std::unique_ptr<PrototypeAST> P);
+// compiles a top level expression and runs it right away
+void VMRunTopLevelExpr(FunctionAST &F);
@@ -0,0 +1,361 @@
+#include "include/interpreter.h"
+#include "include/AST.h"
+#include "include/parser.h"
+#include "include/runtime.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+// Evaluates the AST directly, for scripts so short that generating code
+// costs more than running them. Everything behaves as the code codegen.cpp
+// emits for it would, down to NaN comparisons and self tail calls running in
+// constant stack. Memoization is left out as it never changes a result, and
+// array accesses in loops are bounds checked one at a time.
+
+namespace {
+// a function the program can call, either defined in it or an extern
+// resolved to a native function
+struct Callee {
+  FunctionAST *Def = nullptr;
+  void *Native = nullptr;
+  unsigned NumArgs = 0;
+  // when the definition or extern was read, see lookupFunction
+  unsigned Generation = 0;
+  // set on an extern once the program defines it, calls bound to the extern
+  // run the definition from then on
+  const Callee *Definition = nullptr;
+};
+} // namespace
+
+// every definition and extern of each name, oldest first
+static std::map<std::string, std::vector<std::unique_ptr<Callee>>> Functions;
+static unsigned Generation = 0;
+// definitions stay alive after being redefined, a caller may still run them
+static std::vector<std::unique_ptr<FunctionAST>> Definitions;
+
+// variables in scope, innermost last. Those of the function being evaluated
+// start at FrameBase.
+static std::vector<std::pair<const std::string *, double>> Frame;
+static size_t FrameBase = 0;
+static FunctionAST *CurrentFunction = nullptr;
+// generation of the function being evaluated, which decides what the names it
+// calls refer to
+static unsigned CurrentGeneration = 0;
+// set by a self call in tail position, whose arguments callFunction binds
+// before evaluating the body again
+static bool TailCallPending = false;
+static SmallVector<double, 8> TailArgs;
+
+void RuntimeError(const char *Str, SourceLocation Loc) {
+  flushd();
+  fprintf(stderr, "Error (Line %d, Col %d): %s\n", Loc.Line, Loc.Col, Str);
+  exit(1);
+}
+
+// index into Frame of the innermost variable Name
+static size_t lookupVariable(const std::string &Name, SourceLocation Loc) {
+  for (size_t I = Frame.size(); I-- > FrameBase;)
+    if (*Frame[I].first == Name)
+      return I;
+  RuntimeError("Unkown variable name", Loc);
+}
+
+static bool isBound(const std::string &Name) {
+  for (size_t I = FrameBase; I != Frame.size(); ++I)
+    if (*Frame[I].first == Name)
+      return true;
+  return false;
+}
+
+void *findNative(const std::string &Name) {
+  static const std::map<std::string, void *> Runtime{
+      {"putchard", (void *)&putchard}, {"printd", (void *)&printd},
+      {"flushd", (void *)&flushd},     {"clockd", (void *)&clockd},
+      {"rdtscd", (void *)&rdtscd},
+  };
+  auto It = Runtime.find(Name);
+  if (It != Runtime.end())
+    return It->second;
+  static bool Loaded = !sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  return Loaded ? sys::DynamicLibrary::SearchForAddressOfSymbol(Name)
+                : nullptr;
+}
+
+double callNative(void *Fn, const double *A, unsigned NumArgs,
+                  SourceLocation Loc) {
+  using D = double;
+  switch (NumArgs) {
+  case 0:
+    return reinterpret_cast<D (*)()>(Fn)();
+  case 1:
+    return reinterpret_cast<D (*)(D)>(Fn)(A[0]);
+  case 2:
+    return reinterpret_cast<D (*)(D, D)>(Fn)(A[0], A[1]);
+  case 3:
+    return reinterpret_cast<D (*)(D, D, D)>(Fn)(A[0], A[1], A[2]);
+  case 4:
+    return reinterpret_cast<D (*)(D, D, D, D)>(Fn)(A[0], A[1], A[2], A[3]);
+  case 5:
+    return reinterpret_cast<D (*)(D, D, D, D, D)>(Fn)(A[0], A[1], A[2], A[3],
+                                                      A[4]);
+  case 6:
+    return reinterpret_cast<D (*)(D, D, D, D, D, D)>(Fn)(A[0], A[1], A[2],
+                                                         A[3], A[4], A[5]);
+  }
+  RuntimeError("Externs with more than 6 arguments can't be interpreted", Loc);
+}
+
+static double callFunction(const Callee &C, const double *Args,
+                           SourceLocation Loc) {
+  if (!C.Def) {
+    if (!C.Native)
+      RuntimeError("Unresolved extern", Loc);
+    return callNative(C.Native, Args, C.NumArgs, Loc);
+  }
+
+  FunctionAST *F = C.Def;
+  const std::vector<std::string> &Params = F->getProto().getArgs();
+  size_t OldBase = FrameBase;
+  FunctionAST *OldFunction = CurrentFunction;
+  unsigned OldGeneration = CurrentGeneration;
+  FrameBase = Frame.size();
+  CurrentFunction = F;
+  CurrentGeneration = C.Generation;
+  for (unsigned I = 0; I != C.NumArgs; ++I)
+    Frame.push_back({&Params[I], Args[I]});
+
+  double Result;
+  while (true) {
+    Result = F->getBody().eval();
+    if (!TailCallPending)
+      break;
+    TailCallPending = false;
+    for (unsigned I = 0; I != C.NumArgs; ++I)
+      Frame[FrameBase + I].second = TailArgs[I];
+  }
+
+  Frame.resize(FrameBase);
+  FrameBase = OldBase;
+  CurrentFunction = OldFunction;
+  CurrentGeneration = OldGeneration;
+  return Result;
+}
+
+// What Name referred to when the function being evaluated was read, so a
+// later redefinition doesn't change its callers, as in codegen. A name that
+// wasn't known yet gets its first definition.
+static const Callee *lookupFunction(const std::string &Name) {
+  auto It = Functions.find(Name);
+  if (It == Functions.end())
+    return nullptr;
+  const Callee *C = It->second.front().get();
+  for (auto &Slot : It->second)
+    if (Slot->Generation <= CurrentGeneration)
+      C = Slot.get();
+  return C->Definition ? C->Definition : C;
+}
+
+static bool isArrayBuiltin(const std::string &Name, unsigned NumArgs) {
+  return kdarray_builtin(Name, NumArgs, [](const std::string &Name) {
+    return lookupFunction(Name) != nullptr;
+  });
+}
+
+double NumberExprAST::eval() { return m_Val; }
+
+double StringExprAST::eval() { return kdarray_handle(m_Val.c_str()); }
+
+double VariableExprAST::eval() {
+  return Frame[lookupVariable(m_Name, getLocation())].second;
+}
+
+double IndexExprAST::eval() {
+  double Array = Frame[lookupVariable(m_Array, getLocation())].second;
+  return *kdarray_element(Array, m_Index->eval(), getLine());
+}
+
+double UnaryExprAST::eval() {
+  double Operand = m_Operand->eval();
+  const Callee *F = lookupFunction(std::string("unary") + m_Opcode);
+  if (!F)
+    RuntimeError("Unknown unary operator", getLocation());
+  return callFunction(*F, &Operand, getLocation());
+}
+
+double BinaryExprAST::eval() {
+  if (m_Op == '=') {
+    double Val = m_RHS->eval();
+    if (auto *LHSI = dynamic_cast<IndexExprAST *>(m_LHS.get())) {
+      double Array =
+          Frame[lookupVariable(LHSI->getArray(), getLocation())].second;
+      *kdarray_element(Array, LHSI->getIndex().eval(), getLine()) = Val;
+      return Val;
+    }
+    auto *LHSE = dynamic_cast<VariableExprAST *>(m_LHS.get());
+    if (!LHSE)
+      RuntimeError("Unknown variable name", getLocation());
+    Frame[lookupVariable(LHSE->getName(), getLocation())].second = Val;
+    return Val;
+  }
+
+  double Ops[] = {m_LHS->eval(), m_RHS->eval()};
+  switch (m_Op) {
+  case '+':
+    return Ops[0] + Ops[1];
+  case '-':
+    return Ops[0] - Ops[1];
+  case '*':
+    return Ops[0] * Ops[1];
+  case '/':
+    return Ops[0] / Ops[1];
+  case '<':
+    // unordered or less than, as fcmp ult
+    return !(Ops[0] >= Ops[1]);
+  default:
+    break;
+  }
+  const Callee *F = lookupFunction(std::string("binary") + m_Op);
+  if (!F)
+    RuntimeError("Unknown binary operator", getLocation());
+  return callFunction(*F, Ops, getLocation());
+}
+
+// the function bench(f, n) times while the runtime calls it
+static const Callee *BenchTarget;
+static double benchTrampoline() {
+  return callFunction(*BenchTarget, nullptr, SourceLocation());
+}
+
+double CallExprAST::eval() {
+  if (isArrayBuiltin(m_Callee, m_Args.size())) {
+    double Arg = m_Args[0]->eval();
+    if (m_Callee == "len" || m_Callee == "maplen")
+      return double(uint64_t(kdarray_length(kdarray_pointer(Arg))));
+    if (m_Callee == "loadd")
+      return *kdarray_element(Arg, m_Args[1]->eval(), getLine());
+    if (m_Callee == "array")
+      return kdarray_handle(kdarray_new(Arg));
+    return kdarray_handle(
+        kdarray_map(reinterpret_cast<const char *>(kdarray_pointer(Arg))));
+  }
+
+  const Callee *F = lookupFunction(m_Callee);
+  if (!F)
+    RuntimeError("Unknown Function refrenced", getLocation());
+  if (F->NumArgs != m_Args.size())
+    RuntimeError("Incorrect # of arguments", getLocation());
+
+  // bench(f, n) is handed the function f itself rather than its value
+  if (m_Callee == "bench" && !F->Def && m_Args.size() == 2)
+    if (auto *Fn = dynamic_cast<VariableExprAST *>(m_Args[0].get()))
+      if (!isBound(Fn->getName())) {
+        const Callee *Timed = lookupFunction(Fn->getName());
+        if (!Timed || Timed->NumArgs != 0)
+          RuntimeError("bench expects a function without arguments",
+                       getLocation());
+        double Iters = m_Args[1]->eval();
+        if (!Timed->Def)
+          return kdbench(reinterpret_cast<double (*)()>(Timed->Native), Iters);
+        const Callee *OldTarget = BenchTarget;
+        BenchTarget = Timed;
+        double Median = kdbench(benchTrampoline, Iters);
+        BenchTarget = OldTarget;
+        return Median;
+      }
+
+  SmallVector<double, 8> Args;
+  for (auto &Arg : m_Args)
+    Args.push_back(Arg->eval());
+
+  // a self call in tail position goes back to the top of the body
+  if (m_IsTail && F->Def && F->Def == CurrentFunction) {
+    TailArgs = Args;
+    TailCallPending = true;
+    return 0;
+  }
+  return callFunction(*F, Args.data(), getLocation());
+}
+
+double IfExprAST::eval() {
+  if (isTrue(m_Cond->eval()))
+    return m_Then->eval();
+  return m_Else->eval();
+}
+
+double ForExprAST::eval() {
+  // the start value is evaluated before the variable is in scope
+  double Start = m_Start->eval();
+  size_t Var = Frame.size();
+  Frame.push_back({&m_VarName, Start});
+  while (true) {
+    m_Body->eval();
+    double Step = m_Step ? m_Step->eval() : 1.0;
+    double End = m_End->eval();
+    Frame[Var].second += Step;
+    if (!isTrue(End))
+      break;
+  }
+  Frame.resize(Var);
+  return 0;
+}
+
+double VarExprAST::eval() {
+  size_t Scope = Frame.size();
+  // each initializer is evaluated before its own variable is in scope
+  for (auto &NamedVar : m_VarNames) {
+    double Init = NamedVar.second ? NamedVar.second->eval() : 0.0;
+    Frame.push_back({&NamedVar.first, Init});
+  }
+  double Result = m_Body->eval();
+  Frame.resize(Scope);
+  return Result;
+}
+
+void InterpretDefinition(std::unique_ptr<FunctionAST> F) {
+  PrototypeAST &P = F->getProto();
+  if (P.isBinaryOp())
+    BinopPrecedence[P.getOperatorName()] = P.getBianryPrecedence();
+  F->getBody().markTail();
+  auto C = std::make_unique<Callee>();
+  C->Def = F.get();
+  C->NumArgs = P.getArgs().size();
+  C->Generation = ++Generation;
+  // a forward declared extern now names this function instead of a native
+  // symbol of the same name
+  auto &Slots = Functions[P.getName()];
+  if (!Slots.empty() && !Slots.back()->Def && !Slots.back()->Definition &&
+      Slots.back()->NumArgs == C->NumArgs)
+    Slots.back()->Definition = C.get();
+  Slots.push_back(std::move(C));
+  Definitions.push_back(std::move(F));
+}
+
+void InterpretExtern(std::unique_ptr<PrototypeAST> P) {
+  // an extern doesn't replace a definition of the same name, as in codegen,
+  // and declaring one again keeps it so a later definition binds all of its
+  // callers
+  auto &Slots = Functions[P->getName()];
+  unsigned NumArgs = P->getArgs().size();
+  if (!Slots.empty() && (Slots.back()->Def || Slots.back()->NumArgs == NumArgs))
+    return;
+  auto C = std::make_unique<Callee>();
+  C->Native = findNative(P->getName());
+  C->NumArgs = NumArgs;
+  C->Generation = ++Generation;
+  Slots.push_back(std::move(C));
+}
+
+void InterpretTopLevelExpr(FunctionAST &F) {
+  Callee C;
+  C.Def = &F;
+  C.Generation = Generation;
+  callFunction(C, nullptr, SourceLocation());
+}
@@ -48,6 +48,10 @@ Token Lexer::getToken() {
       T.Type = tok_unary;
     else if (T.StrVal == "var")
       T.Type = tok_var;
+    else if (T.StrVal == "pure")
+      T.Type = tok_pure;
+    else if (T.StrVal == "memo")
+      T.Type = tok_memo;
     else
       T.Type = tok_identifier;
     return T;
@@ -66,6 +70,20 @@ Token Lexer::getToken() {
     return T;
   }
 
+  // recognise string literals, there are no escapes
+  if (LastChar == '"') {
+    while ((LastChar = advance()) != EOF && LastChar != '"')
+      T.StrVal += LastChar;
+    if (LastChar == EOF) {
+      T.StrVal = "unterminated string literal";
+      T.Type = tok_error;
+      return T;
+    }
+    LastChar = advance(); // eat closing "
+    T.Type = tok_string;
+    return T;
+  }
+
   // recognise commments
   if (LastChar == '#') {
     // comment lasts until end of line
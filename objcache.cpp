@@ -0,0 +1,245 @@
+#include "include/objcache.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <chrono>
+#include <set>
+
+using namespace llvm;
+
+ObjectFileCache::ObjectFileCache(std::string Dir, uint64_t MaxBytes)
+    : m_Dir(std::move(Dir)), m_MaxBytes(MaxBytes) {
+  sys::fs::create_directories(m_Dir);
+}
+
+std::string ObjectFileCache::computeKey(const Module &M, StringRef CPU,
+                                        StringRef Features) {
+  // the printed module carries the target triple and data layout
+  std::string IR;
+  raw_string_ostream OS(IR);
+  M.print(OS, nullptr);
+
+  MD5 Hash;
+  Hash.update(IR);
+  Hash.update(CPU);
+  Hash.update(Features);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  return std::string(Result.digest());
+}
+
+std::string ObjectFileCache::getPath(StringRef Key) const {
+  SmallString<128> Path(m_Dir);
+  sys::path::append(Path, "llvmcache-" + Key);
+  return std::string(Path);
+}
+
+// mark an entry as used, pruneCache goes by the modification time and
+// access times are not updated on noatime or relatime mounts
+static void touch(const Twine &Path) {
+  int FD;
+  if (sys::fs::openFileForRead(Path, FD))
+    return;
+  sys::fs::setLastAccessAndModificationTime(FD,
+                                            std::chrono::system_clock::now());
+  sys::Process::SafelyCloseFileDescriptor(FD);
+}
+
+bool ObjectFileCache::contains(StringRef Key) {
+  std::string Path = getPath(Key);
+  if (sys::fs::exists(Path)) {
+    touch(Path);
+    Hits++;
+    return true;
+  }
+  Misses++;
+  return false;
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::lookup(StringRef Key) {
+  std::string Path = getPath(Key);
+  auto Buffer = MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    Misses++;
+    return nullptr;
+  }
+  touch(Path);
+  Hits++;
+  return std::move(*Buffer);
+}
+
+bool ObjectFileCache::store(StringRef Key, StringRef Object) {
+  // write to a temporary and rename it so readers never see half an object
+  int FD;
+  SmallString<128> TmpPath;
+  if (sys::fs::createUniqueFile(m_Dir + "/tmp-%%%%%%%%.o", FD, TmpPath))
+    return false;
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Object;
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(TmpPath);
+      return false;
+    }
+  }
+  if (sys::fs::rename(TmpPath, getPath(Key))) {
+    sys::fs::remove(TmpPath);
+    return false;
+  }
+  return true;
+}
+
+void ObjectFileCache::prune() {
+  CachePruningPolicy Policy;
+  Policy.Interval = std::chrono::seconds(0);
+  Policy.MaxSizeBytes = m_MaxBytes;
+  pruneCache(m_Dir, Policy);
+}
+
+JITObjectCache::JITObjectCache(ObjectFileCache &Cache, StringRef Target,
+                               StringRef Features)
+    : m_Cache(Cache), m_Target(Target.str()), m_Features(Features.str()) {}
+
+std::unique_ptr<MemoryBuffer> JITObjectCache::getObject(const Module *M) {
+  std::string Key = ObjectFileCache::computeKey(*M, m_Target, m_Features);
+  std::lock_guard<std::mutex> Lock(m_Mutex);
+  if (auto Object = m_Cache.lookup(Key))
+    return Object;
+  m_Pending[M] = std::move(Key);
+  return nullptr;
+}
+
+void JITObjectCache::notifyObjectCompiled(const Module *M,
+                                          MemoryBufferRef Obj) {
+  std::lock_guard<std::mutex> Lock(m_Mutex);
+  auto It = m_Pending.find(M);
+  if (It == m_Pending.end())
+    return;
+  m_Cache.store(It->second, Obj.getBuffer());
+  m_Pending.erase(It);
+}
+
+// collect every global the body of F refers to, looking through constants
+static void collectGlobals(Value *V, std::set<GlobalValue *> &Globals,
+                           std::set<Constant *> &Visited) {
+  if (auto *GV = dyn_cast<GlobalValue>(V)) {
+    Globals.insert(GV);
+    return;
+  }
+  auto *C = dyn_cast<Constant>(V);
+  if (!C || !Visited.insert(C).second)
+    return;
+  for (Value *Op : C->operands())
+    collectGlobals(Op, Globals, Visited);
+}
+
+// copy F into a module of its own with declarations for everything it uses
+static std::unique_ptr<Module> extractFunction(Function &F) {
+  Module &M = *F.getParent();
+  auto Part = std::make_unique<Module>(F.getName(), F.getContext());
+  Part->setTargetTriple(M.getTargetTriple());
+  Part->setDataLayout(M.getDataLayout());
+
+  Function *NewF = Function::Create(F.getFunctionType(), F.getLinkage(),
+                                    F.getName(), Part.get());
+  ValueToValueMapTy VMap;
+  VMap[&F] = NewF;
+  auto NewArg = NewF->arg_begin();
+  for (Argument &Arg : F.args()) {
+    NewArg->setName(Arg.getName());
+    VMap[&Arg] = &*NewArg++;
+  }
+
+  std::set<GlobalValue *> Globals;
+  std::set<Constant *> Visited;
+  for (Instruction &I : instructions(F))
+    for (Value *Op : I.operands())
+      collectGlobals(Op, Globals, Visited);
+
+  for (GlobalValue *GV : Globals) {
+    if (GV == &F)
+      continue;
+    if (auto *Callee = dyn_cast<Function>(GV)) {
+      Function *Decl =
+          Function::Create(Callee->getFunctionType(), Function::ExternalLinkage,
+                           Callee->getName(), Part.get());
+      Decl->setAttributes(Callee->getAttributes());
+      Decl->setVisibility(Callee->getVisibility());
+      VMap[Callee] = Decl;
+    } else if (auto *Var = dyn_cast<GlobalVariable>(GV)) {
+      auto *Decl = new GlobalVariable(*Part, Var->getValueType(),
+                                      Var->isConstant(),
+                                      GlobalValue::ExternalLinkage, nullptr,
+                                      Var->getName());
+      Decl->setVisibility(Var->getVisibility());
+      VMap[Var] = Decl;
+    }
+  }
+
+  SmallVector<ReturnInst *, 8> Returns;
+  CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule,
+                    Returns);
+  return Part;
+}
+
+bool emitCachedObjects(Module &M, TargetMachine &TM, ObjectFileCache &Cache,
+                       std::vector<std::string> &Objects) {
+  // every function lands in its own object, so anything local has to become
+  // visible to the other objects of the executable
+  for (GlobalValue &GV : M.global_values()) {
+    if (GV.isDeclaration() || !GV.hasLocalLinkage())
+      continue;
+    if (!GV.hasName())
+      GV.setName("__kd_local");
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setVisibility(GlobalValue::HiddenVisibility);
+  }
+
+  std::vector<std::unique_ptr<Module>> Parts;
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      Parts.push_back(extractFunction(F));
+  if (!M.global_empty()) {
+    ValueToValueMapTy VMap;
+    Parts.push_back(CloneModule(M, VMap, [](const GlobalValue *GV) {
+      return isa<GlobalVariable>(GV);
+    }));
+  }
+
+  Cache.prune();
+  for (auto &Part : Parts) {
+    std::string Key =
+        ObjectFileCache::computeKey(*Part, TM.getTargetCPU(),
+                                    TM.getTargetFeatureString());
+    if (!Cache.contains(Key)) {
+      SmallVector<char, 0> Object;
+      raw_svector_ostream OS(Object);
+      legacy::PassManager pass;
+      if (TM.addPassesToEmitFile(pass, OS, nullptr,
+                                 CodeGenFileType::ObjectFile)) {
+        errs() << "TargetMachine can't emit a file of this type";
+        return false;
+      }
+      pass.run(*Part);
+      if (!Cache.store(Key, StringRef(Object.data(), Object.size()))) {
+        errs() << "Could not write to the object cache\n";
+        return false;
+      }
+    }
+    Objects.push_back(Cache.getPath(Key));
+  }
+  return true;
+}
@@ -40,10 +40,22 @@ std::unique_ptr<ExprAST> ParseParenExpr() {
 
 // for parsing identifiers, funcitons calls
 // identifier := identifier
+//            := identifier '[' expression ']'
 //            := identifier '(' expression ')'
 std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   std::string IdName = CurTok.StrVal;
   getNextToken();         // eat Identifier
+  if (CurTok.Type == '[') { // array element
+    getNextToken();         // eat [
+    auto Index = ParseExpression();
+    if (!Index)
+      return nullptr;
+    if (CurTok.Type != ']')
+      return LogError<ExprAST>("Expected ']'");
+    getNextToken(); // eat ]
+    return std::make_unique<IndexExprAST>(CurTok.Loc, IdName,
+                                          std::move(Index));
+  }
   if (CurTok.Type != '(') // this implies it is a variable
     return std::make_unique<VariableExprAST>(CurTok.Loc, IdName);
 
@@ -74,6 +86,13 @@ std::unique_ptr<ExprAST> ParseNumberExpr() {
   return std::move(Result);
 }
 
+// stringexpr := string
+std::unique_ptr<ExprAST> ParseStringExpr() {
+  auto Result = std::make_unique<StringExprAST>(CurTok.Loc, CurTok.StrVal);
+  getNextToken();
+  return std::move(Result);
+}
+
 std::unique_ptr<ExprAST> ParseIfExpr();
 
 // forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
@@ -168,6 +187,7 @@ std::unique_ptr<ExprAST> ParseVarExpr() {
   primary
   := identifierexpr
   := numberexpr
+  := stringexpr
   := parenexpr
   := ifexpr
   := forexpr
@@ -181,6 +201,10 @@ std::unique_ptr<ExprAST> ParsePrimary() {
     return ParseIdentifierExpr();
   case tok_number:
     return ParseNumberExpr();
+  case tok_string:
+    return ParseStringExpr();
+  case tok_error:
+    return LogError<ExprAST>(CurTok.StrVal.c_str());
   case '(':
     return ParseParenExpr();
   case tok_if:
@@ -317,12 +341,19 @@ std::unique_ptr<PrototypeAST> ParsePrototype() {
                                         BinaryPrecedence);
 }
 
-// definition := 'def' prototype expression
+// definition := 'def' ['memo'] prototype expression
 std::unique_ptr<FunctionAST> ParseDefinition() {
   getNextToken();
+  bool IsMemo = false;
+  if (CurTok.Type == tok_memo) {
+    IsMemo = true;
+    getNextToken(); // eat memo
+  }
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
+  if (IsMemo)
+    Proto->setMemo();
 
   if (auto E = ParseExpression())
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
@@ -330,10 +361,18 @@ std::unique_ptr<FunctionAST> ParseDefinition() {
   return nullptr;
 }
 
-// external := extern prototype
+// external := extern ['pure'] prototype
 std::unique_ptr<PrototypeAST> ParseExtern() {
   getNextToken(); // eat extern
-  return ParsePrototype();
+  bool IsPure = false;
+  if (CurTok.Type == tok_pure) {
+    IsPure = true;
+    getNextToken(); // eat pure
+  }
+  auto Proto = ParsePrototype();
+  if (Proto && IsPure)
+    Proto->setPure();
+  return Proto;
 }
 
 // toplevelexpr := expression
@@ -1,4 +1,20 @@
+#include "include/runtime.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
@@ -6,13 +22,167 @@
 #define DLLEXPORT
 #endif
 
+// Output is collected in a user space buffer and written out in one go when
+// it fills up, on flushd() and at exit, instead of one write per character.
+// Setting KD_OUTPUT=stdout sends it to stdout instead of stderr.
+static char OutBuf[1 << 16];
+static size_t OutLen = 0;
+static FILE *OutFile = nullptr;
+
+static void flushOutput() {
+  fwrite(OutBuf, 1, OutLen, OutFile);
+  fflush(OutFile);
+  OutLen = 0;
+}
+
+// make room for N more characters and return where they go
+static char *reserveOutput(size_t N) {
+  if (!OutFile) {
+    const char *Target = getenv("KD_OUTPUT");
+    OutFile = Target && !strcmp(Target, "stdout") ? stdout : stderr;
+    atexit(flushOutput);
+  }
+  if (OutLen + N > sizeof(OutBuf))
+    flushOutput();
+  return OutBuf + OutLen;
+}
+
 extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
+  *reserveOutput(1) = (char)X;
+  OutLen++;
   return 0;
 }
 
 /// printd - printf that takes a double prints it as "%f\n", returning 0.
 extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "%f\n", X);
+  // "%f" of the largest double is a little over 300 characters
+  const size_t MaxLen = 400;
+  char *Out = reserveOutput(MaxLen);
+  // to_chars formats exactly like printf without going through the locale
+  // machinery of stdio
+  char *End =
+      std::to_chars(Out, Out + MaxLen - 1, X, std::chars_format::fixed, 6).ptr;
+  *End++ = '\n';
+  OutLen = End - OutBuf;
+  return 0;
+}
+
+/// flushd - writes out everything printed so far, returning 0.
+extern "C" DLLEXPORT double flushd() {
+  if (OutFile)
+    flushOutput();
   return 0;
 }
+
+/// clockd - reads the monotonic clock, returning nanoseconds.
+extern "C" DLLEXPORT double clockd() {
+  timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec * 1e9 + TS.tv_nsec;
+}
+
+/// rdtscd - reads the cycle counter. Calls from Kaleidoscope code are
+/// compiled to llvm.readcyclecounter, this is for other callers.
+extern "C" DLLEXPORT double rdtscd() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return clockd();
+#endif
+}
+
+/// kdbench - calls F Iters times and prints the minimum, median and 99th
+/// percentile time of a call in nanoseconds, returning the median. This is
+/// what bench(f, n) is compiled to.
+extern "C" DLLEXPORT double kdbench(double (*F)(), double Iters) {
+  size_t N = Iters < 1 ? 1 : (size_t)Iters;
+  std::vector<double> Times(N);
+  for (size_t I = 0; I != N; ++I) {
+    double Start = clockd();
+    F();
+    Times[I] = clockd() - Start;
+  }
+  std::sort(Times.begin(), Times.end());
+  double Median = Times[(N - 1) / 2];
+
+  const size_t MaxLen = 128;
+  char *Out = reserveOutput(MaxLen);
+  int Len = snprintf(Out, MaxLen,
+                     "bench: %zu runs, min %.0f ns, median %.0f ns, "
+                     "p99 %.0f ns\n",
+                     N, Times[0], Median, Times[(N - 1) * 99 / 100]);
+  OutLen += std::min<size_t>(Len, MaxLen - 1);
+  return Median;
+}
+
+/// kdarray_new - allocates an array of N zeroed doubles, returning a pointer
+/// to the first one. The length is stored in the 8 bytes before it and the
+/// elements start on a cache line.
+extern "C" DLLEXPORT double *kdarray_new(double N) {
+  const size_t Align = 64;
+  // far more than fits in memory, so it fails like any allocation failure
+  size_t Len = N > 0 ? (size_t)std::min(N, 0x1p50) : 0;
+  size_t Bytes = Align + (Len * sizeof(double) + Align - 1) / Align * Align;
+  char *Base = (char *)aligned_alloc(Align, Bytes);
+  if (!Base) {
+    flushd();
+    fprintf(stderr, "Error: out of memory allocating an array of %zu elements\n",
+            Len);
+    exit(1);
+  }
+  memset(Base, 0, Bytes);
+  double *Elements = (double *)(Base + Align);
+  ((int64_t *)Elements)[-1] = Len;
+  return Elements;
+}
+
+/// kdarray_oob - reports an array access out of bounds on line Line and
+/// exits.
+extern "C" DLLEXPORT void kdarray_oob(int64_t Index, int64_t Len,
+                                      int32_t Line) {
+  flushd();
+  fprintf(stderr,
+          "Error (Line %d): array index %lld out of bounds for length %lld\n",
+          Line, (long long)Index, (long long)Len);
+  exit(1);
+}
+
+static void mapFailed(const char *Path) {
+  flushd();
+  fprintf(stderr, "Error: could not map %s: %s\n", Path, strerror(errno));
+  exit(1);
+}
+
+/// kdarray_map - maps the file at Path as an array of the doubles it holds,
+/// returning a pointer to the first one. The file is mapped right after a
+/// page of its own that holds the length, so it is laid out like any other
+/// array without being copied. The mapping is copy-on-write, as a mapped
+/// array can be assigned to like any other; the file itself never changes.
+extern "C" DLLEXPORT double *kdarray_map(const char *Path) {
+  int FD = open(Path, O_RDONLY);
+  struct stat Stat;
+  if (FD < 0 || fstat(FD, &Stat) < 0)
+    mapFailed(Path);
+  size_t Page = sysconf(_SC_PAGESIZE);
+  size_t Bytes = Stat.st_size;
+
+  // reserve the header page and the file's range in one go, then put the
+  // file over the second part
+  char *Base = (char *)mmap(nullptr, Page + Bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (Base == MAP_FAILED)
+    mapFailed(Path);
+  double *Elements = (double *)(Base + Page);
+  if (Bytes) {
+    if (mmap(Elements, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             FD, 0) == MAP_FAILED)
+      mapFailed(Path);
+    // loops stream through the data front to back
+    madvise(Elements, Bytes, MADV_SEQUENTIAL);
+  }
+  close(FD);
+
+  ((int64_t *)Elements)[-1] = Bytes / sizeof(double);
+  mprotect(Base, Page, PROT_READ);
+  return Elements;
+}
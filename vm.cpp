@@ -0,0 +1,754 @@
+#include "include/vm.h"
+#include "include/AST.h"
+#include "include/interpreter.h"
+#include "include/parser.h"
+#include "include/runtime.h"
+#include "llvm/ADT/ArrayRef.h"
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+// A register VM for programs that run too long for the interpreter but not
+// long enough to pay for generating machine code. Functions are compiled to
+// bytecode operating on a frame of double registers: the arguments come
+// first, followed by variables and temporaries allocated in stack order. A
+// call puts its arguments in the first free registers of the caller, which
+// become the start of the callee's frame, so nothing is copied. Programs
+// behave as they do in the interpreter, but unknown names are reported when
+// a definition is compiled, as codegen does.
+
+// dispatch through a table of label addresses where the compiler supports
+// it, a switch otherwise or when built with KALEIDOSCOPE_VM_SWITCH
+#if defined(__GNUC__) && !defined(KALEIDOSCOPE_VM_SWITCH)
+#define VM_COMPUTED_GOTO
+#endif
+
+// operands A, B and C are registers unless noted otherwise
+#define VM_OPCODES(X)                                                          \
+  X(LoadK)   /* A = constant B */                                              \
+  X(Mov)     /* A = B */                                                       \
+  X(Add)     /* A = B + C */                                                   \
+  X(Sub)     /* A = B - C */                                                   \
+  X(Mul)     /* A = B * C */                                                   \
+  X(Div)     /* A = B / C */                                                   \
+  X(Lt)      /* A = B < C, true when unordered */                              \
+  X(Jmp)     /* continue at instruction B */                                   \
+  X(JmpF)    /* continue at instruction B unless A holds */                    \
+  X(JmpT)    /* continue at instruction B if A holds */                        \
+  X(JmpGE)   /* continue at instruction C if A >= B, so not A < B */           \
+  X(Call)    /* A = function B called with the frame starting at C */         \
+  X(CallN)   /* A = native function B of the arguments from C */              \
+  X(Ret)     /* return A */                                                    \
+  X(NewArr)  /* A = array(B) */                                                \
+  X(MapFile) /* A = mapfile(B) */                                              \
+  X(Len)     /* A = len(B) */                                                  \
+  X(LoadE)   /* A = B[C] */                                                    \
+  X(StoreE)  /* B[C] = A */                                                    \
+  X(Bench)   /* A = bench(function B, C) */                                    \
+  X(BenchN)  /* A = bench(native function B, C) */
+
+namespace {
+enum Opcode : uint16_t {
+#define VM_ENUM(Name) Name,
+  VM_OPCODES(VM_ENUM)
+#undef VM_ENUM
+};
+
+struct Instr {
+  uint16_t Op, A, B, C;
+};
+
+struct BytecodeFunction {
+  unsigned NumArgs = 0;
+  unsigned NumRegs = 0;
+  std::vector<Instr> Code;
+  // source line of each instruction, for runtime errors
+  std::vector<int> Lines;
+};
+
+struct NativeFunction {
+  void *Fn;
+  unsigned NumArgs;
+  // index into Functions once the program defines the extern, calls compiled
+  // against the extern run the definition from then on
+  int Def = -1;
+};
+
+// what a name refers to, a function compiled for the VM or an extern
+struct Symbol {
+  bool IsNative;
+  unsigned Index;
+  unsigned NumArgs;
+};
+} // namespace
+
+static std::vector<std::unique_ptr<BytecodeFunction>> Functions;
+static std::vector<NativeFunction> Natives;
+static std::map<std::string, Symbol> Symbols;
+// the constant pool shared by all functions, each value stored once
+static std::vector<double> Constants;
+static std::map<uint64_t, unsigned> ConstantIndex;
+// string literals are pointers into the AST, so definitions are kept
+static std::vector<std::unique_ptr<FunctionAST>> Definitions;
+
+static int LogErrorR(const char *Str, SourceLocation Loc) {
+  fprintf(stderr, "Error (Line %d, Col %d): %s\n", Loc.Line, Loc.Col, Str);
+  return -1;
+}
+
+// state of the function being compiled
+class BytecodeBuilder {
+  BytecodeFunction &F;
+  // first free register
+  unsigned Top = 0;
+  // variables in scope and their registers, innermost last
+  std::vector<std::pair<std::string, unsigned>> Scope;
+
+public:
+  // index of the function in Functions, to recognize self calls
+  const unsigned Index;
+  // an operand didn't fit in an instruction
+  bool Overflow = false;
+
+  BytecodeBuilder(BytecodeFunction &F, unsigned Index) : F(F), Index(Index) {}
+
+  unsigned top() const { return Top; }
+  void reset(unsigned Mark) { Top = Mark; }
+  unsigned newReg() {
+    if (++Top > F.NumRegs)
+      F.NumRegs = Top;
+    return Top - 1;
+  }
+
+  size_t emit(Opcode Op, unsigned A, unsigned B, unsigned C,
+              const ExprAST &E) {
+    if (A > UINT16_MAX || B > UINT16_MAX || C > UINT16_MAX)
+      Overflow = true;
+    F.Code.push_back({Op, uint16_t(A), uint16_t(B), uint16_t(C)});
+    F.Lines.push_back(E.getLine());
+    return F.Code.size() - 1;
+  }
+  size_t here() const { return F.Code.size(); }
+  // make the jump at Jump continue at the next instruction
+  void patch(size_t Jump) {
+    if (here() > UINT16_MAX)
+      Overflow = true;
+    Instr &I = F.Code[Jump];
+    (I.Op == JmpGE ? I.C : I.B) = uint16_t(here());
+  }
+
+  unsigned constant(double V, const ExprAST &E) {
+    uint64_t Bits;
+    std::memcpy(&Bits, &V, sizeof(Bits));
+    auto It = ConstantIndex.try_emplace(Bits, Constants.size()).first;
+    if (It->second == Constants.size())
+      Constants.push_back(V);
+    unsigned R = newReg();
+    emit(LoadK, R, It->second, 0, E);
+    return R;
+  }
+
+  int lookup(const std::string &Name) const {
+    for (auto It = Scope.rbegin(); It != Scope.rend(); ++It)
+      if (It->first == Name)
+        return It->second;
+    return -1;
+  }
+  void bind(const std::string &Name, unsigned R) { Scope.push_back({Name, R}); }
+  void unbind(size_t N) { Scope.resize(Scope.size() - N); }
+
+  // R holds a value computed before Later and used after it. If R is a
+  // variable Later assigns, the value is copied first.
+  unsigned keep(unsigned R, const ExprAST &Later, const ExprAST &E) {
+    for (auto &Var : Scope)
+      if (Var.second == R && Later.assigns(Var.first)) {
+        unsigned Copy = newReg();
+        emit(Mov, Copy, R, 0, E);
+        return Copy;
+      }
+    return R;
+  }
+
+  // the result of an expression that started with Mark free. Registers below
+  // Mark are variables still in scope, anything else is moved down to Mark so
+  // the temporaries above it can be reused.
+  unsigned result(unsigned Mark, unsigned R, const ExprAST &E) {
+    if (R < Mark)
+      return R;
+    reset(Mark);
+    unsigned Dst = newReg();
+    if (R != Dst)
+      emit(Mov, Dst, R, 0, E);
+    return Dst;
+  }
+};
+
+static const Symbol *lookupSymbol(const std::string &Name) {
+  auto It = Symbols.find(Name);
+  return It == Symbols.end() ? nullptr : &It->second;
+}
+
+static bool isArrayBuiltin(const std::string &Name, unsigned NumArgs) {
+  return kdarray_builtin(Name, NumArgs, [](const std::string &Name) {
+    return lookupSymbol(Name) != nullptr;
+  });
+}
+
+static int emitCall(BytecodeBuilder &B, const Symbol &Callee,
+                    ArrayRef<ExprAST *> Args, bool IsTail, const ExprAST &E) {
+  unsigned Base = B.top();
+  for (size_t I = 0; I != Args.size(); ++I)
+    B.newReg();
+  for (size_t I = 0; I != Args.size(); ++I) {
+    int R = Args[I]->emitBytecode(B);
+    if (R < 0)
+      return -1;
+    if (unsigned(R) != Base + I)
+      B.emit(Mov, Base + I, R, 0, E);
+    B.reset(Base + Args.size());
+  }
+
+  // a self call in tail position rebinds the arguments and starts over, so
+  // deep recursion runs in constant stack
+  if (IsTail && !Callee.IsNative && Callee.Index == B.Index) {
+    for (size_t I = 0; I != Args.size(); ++I)
+      B.emit(Mov, I, Base + I, 0, E);
+    B.emit(Jmp, 0, 0, 0, E);
+    B.reset(Base);
+    return B.newReg();
+  }
+
+  B.reset(Base);
+  unsigned Dst = B.newReg();
+  B.emit(Callee.IsNative ? CallN : Call, Dst, Callee.Index, Base, E);
+  return Dst;
+}
+
+int NumberExprAST::emitBytecode(BytecodeBuilder &B) {
+  return B.constant(m_Val, *this);
+}
+
+int StringExprAST::emitBytecode(BytecodeBuilder &B) {
+  return B.constant(kdarray_handle(m_Val.c_str()), *this);
+}
+
+int VariableExprAST::emitBytecode(BytecodeBuilder &B) {
+  int R = B.lookup(m_Name);
+  if (R < 0)
+    return LogErrorR("Unkown variable name", getLocation());
+  return R;
+}
+
+int IndexExprAST::emitBytecode(BytecodeBuilder &B) {
+  unsigned Mark = B.top();
+  int Array = B.lookup(m_Array);
+  if (Array < 0)
+    return LogErrorR("Unkown variable name", getLocation());
+  unsigned A = B.keep(Array, *m_Index, *this);
+  int Idx = m_Index->emitBytecode(B);
+  if (Idx < 0)
+    return -1;
+  B.reset(Mark);
+  unsigned Dst = B.newReg();
+  B.emit(LoadE, Dst, A, Idx, *this);
+  return Dst;
+}
+
+int UnaryExprAST::emitBytecode(BytecodeBuilder &B) {
+  const Symbol *F = lookupSymbol(std::string("unary") + m_Opcode);
+  if (!F)
+    return LogErrorR("Unknown unary operator", getLocation());
+  return emitCall(B, *F, {m_Operand.get()}, false, *this);
+}
+
+int BinaryExprAST::emitBytecode(BytecodeBuilder &B) {
+  unsigned Mark = B.top();
+  if (m_Op == '=') {
+    int Val = m_RHS->emitBytecode(B);
+    if (Val < 0)
+      return -1;
+    // a[i] = x stores to the element
+    if (auto *LHSI = dynamic_cast<IndexExprAST *>(m_LHS.get())) {
+      int Array = B.lookup(LHSI->getArray());
+      if (Array < 0)
+        return LogErrorR("Unknown variable name", getLocation());
+      unsigned V = B.keep(Val, LHSI->getIndex(), *this);
+      unsigned A = B.keep(Array, LHSI->getIndex(), *this);
+      int Idx = LHSI->getIndex().emitBytecode(B);
+      if (Idx < 0)
+        return -1;
+      B.emit(StoreE, V, A, Idx, *this);
+      return B.result(Mark, V, *this);
+    }
+
+    auto *LHSE = dynamic_cast<VariableExprAST *>(m_LHS.get());
+    if (!LHSE)
+      return LogErrorR("Unknown variable name", getLocation());
+    int Var = B.lookup(LHSE->getName());
+    if (Var < 0)
+      return LogErrorR("Unknown variable name", getLocation());
+    if (Val != Var)
+      B.emit(Mov, Var, Val, 0, *this);
+    B.reset(Mark);
+    return Var;
+  }
+
+  Opcode Op;
+  switch (m_Op) {
+  case '+':
+    Op = Add;
+    break;
+  case '-':
+    Op = Sub;
+    break;
+  case '*':
+    Op = Mul;
+    break;
+  case '/':
+    Op = Div;
+    break;
+  case '<':
+    Op = Lt;
+    break;
+  default:
+    // if it was not a builtin operator then it was user defined
+    const Symbol *F = lookupSymbol(std::string("binary") + m_Op);
+    if (!F)
+      return LogErrorR("Unknown binary operator", getLocation());
+    return emitCall(B, *F, {m_LHS.get(), m_RHS.get()}, false, *this);
+  }
+
+  int L = m_LHS->emitBytecode(B);
+  if (L < 0)
+    return -1;
+  L = B.keep(L, *m_RHS, *this);
+  int R = m_RHS->emitBytecode(B);
+  if (R < 0)
+    return -1;
+  B.reset(Mark);
+  unsigned Dst = B.newReg();
+  B.emit(Op, Dst, L, R, *this);
+  return Dst;
+}
+
+int CallExprAST::emitBytecode(BytecodeBuilder &B) {
+  unsigned Mark = B.top();
+  if (isArrayBuiltin(m_Callee, m_Args.size())) {
+    int Arg = m_Args[0]->emitBytecode(B);
+    if (Arg < 0)
+      return -1;
+    if (m_Callee == "loadd") {
+      unsigned A = B.keep(Arg, *m_Args[1], *this);
+      int Idx = m_Args[1]->emitBytecode(B);
+      if (Idx < 0)
+        return -1;
+      B.reset(Mark);
+      unsigned Dst = B.newReg();
+      B.emit(LoadE, Dst, A, Idx, *this);
+      return Dst;
+    }
+    Opcode Op = m_Callee == "array"     ? NewArr
+                : m_Callee == "mapfile" ? MapFile
+                                        : Len;
+    B.reset(Mark);
+    unsigned Dst = B.newReg();
+    B.emit(Op, Dst, Arg, 0, *this);
+    return Dst;
+  }
+
+  const Symbol *Callee = lookupSymbol(m_Callee);
+  if (!Callee)
+    return LogErrorR("Unknown Function refrenced", getLocation());
+  if (Callee->NumArgs != m_Args.size())
+    return LogErrorR("Incorrect # of arguments", getLocation());
+
+  // bench(f, n) is handed the function f itself rather than its value
+  if (m_Callee == "bench" && Callee->IsNative && m_Args.size() == 2)
+    if (auto *Fn = dynamic_cast<VariableExprAST *>(m_Args[0].get()))
+      if (B.lookup(Fn->getName()) < 0) {
+        const Symbol *Timed = lookupSymbol(Fn->getName());
+        if (!Timed || Timed->NumArgs != 0)
+          return LogErrorR("bench expects a function without arguments",
+                           getLocation());
+        int Iters = m_Args[1]->emitBytecode(B);
+        if (Iters < 0)
+          return -1;
+        B.reset(Mark);
+        unsigned Dst = B.newReg();
+        B.emit(Timed->IsNative ? BenchN : Bench, Dst, Timed->Index, Iters,
+               *this);
+        return Dst;
+      }
+
+  std::vector<ExprAST *> Args;
+  for (auto &Arg : m_Args)
+    Args.push_back(Arg.get());
+  return emitCall(B, *Callee, Args, m_IsTail, *this);
+}
+
+int IfExprAST::emitBytecode(BytecodeBuilder &B) {
+  unsigned Mark = B.top();
+  // branch on a comparison directly instead of on its value
+  size_t ToElse;
+  auto *Cmp = dynamic_cast<BinaryExprAST *>(m_Cond.get());
+  if (Cmp && Cmp->getOp() == '<') {
+    int L = Cmp->getLHS().emitBytecode(B);
+    if (L < 0)
+      return -1;
+    L = B.keep(L, Cmp->getRHS(), *this);
+    int R = Cmp->getRHS().emitBytecode(B);
+    if (R < 0)
+      return -1;
+    ToElse = B.emit(JmpGE, L, R, 0, *this);
+  } else {
+    int Cond = m_Cond->emitBytecode(B);
+    if (Cond < 0)
+      return -1;
+    ToElse = B.emit(JmpF, Cond, 0, 0, *this);
+  }
+
+  B.reset(Mark);
+  unsigned Dst = B.newReg();
+  int Then = m_Then->emitBytecode(B);
+  if (Then < 0)
+    return -1;
+  if (unsigned(Then) != Dst)
+    B.emit(Mov, Dst, Then, 0, *this);
+  size_t ToEnd = B.emit(Jmp, 0, 0, 0, *this);
+
+  B.patch(ToElse);
+  B.reset(Dst + 1);
+  int Else = m_Else->emitBytecode(B);
+  if (Else < 0)
+    return -1;
+  if (unsigned(Else) != Dst)
+    B.emit(Mov, Dst, Else, 0, *this);
+  B.patch(ToEnd);
+  B.reset(Dst + 1);
+  return Dst;
+}
+
+int ForExprAST::emitBytecode(BytecodeBuilder &B) {
+  unsigned Mark = B.top();
+  // the start value is computed before the variable is in scope
+  int Start = m_Start->emitBytecode(B);
+  if (Start < 0)
+    return -1;
+  B.reset(Mark);
+  unsigned Var = B.newReg();
+  if (unsigned(Start) != Var)
+    B.emit(Mov, Var, Start, 0, *this);
+  B.bind(m_VarName, Var);
+
+  size_t Loop = B.here();
+  if (m_Body->emitBytecode(B) < 0)
+    return -1;
+  B.reset(Var + 1);
+  int Step = m_Step ? m_Step->emitBytecode(B) : B.constant(1.0, *this);
+  if (Step < 0)
+    return -1;
+  Step = B.keep(Step, *m_End, *this);
+  // the end condition is computed before the variable is stepped
+  int End = m_End->emitBytecode(B);
+  if (End < 0)
+    return -1;
+  if (unsigned(End) == Var) {
+    End = B.newReg();
+    B.emit(Mov, End, Var, 0, *this);
+  }
+  B.emit(Add, Var, Var, Step, *this);
+  B.emit(JmpT, End, Loop, 0, *this);
+
+  B.unbind(1);
+  B.reset(Mark);
+  // `for loop` expr always return 0
+  return B.constant(0.0, *this);
+}
+
+int VarExprAST::emitBytecode(BytecodeBuilder &B) {
+  unsigned Mark = B.top();
+  for (auto &NamedVar : m_VarNames) {
+    // the initializer can't see the variable it initializes
+    unsigned Slot = B.top();
+    int Init = NamedVar.second ? NamedVar.second->emitBytecode(B)
+                               : B.constant(0.0, *this);
+    if (Init < 0)
+      return -1;
+    B.reset(Slot);
+    unsigned R = B.newReg();
+    if (unsigned(Init) != R)
+      B.emit(Mov, R, Init, 0, *this);
+    B.bind(NamedVar.first, R);
+  }
+
+  int Body = m_Body->emitBytecode(B);
+  if (Body < 0)
+    return -1;
+  B.unbind(m_VarNames.size());
+  return B.result(Mark, Body, *this);
+}
+
+static bool compileFunction(FunctionAST &F, BytecodeFunction &Fn,
+                            unsigned Index) {
+  BytecodeBuilder B(Fn, Index);
+  const std::vector<std::string> &Params = F.getProto().getArgs();
+  Fn.NumArgs = Params.size();
+  for (const std::string &Param : Params)
+    B.bind(Param, B.newReg());
+
+  F.getBody().markTail();
+  int Result = F.getBody().emitBytecode(B);
+  if (Result < 0)
+    return false;
+  B.emit(Ret, Result, 0, 0, F.getBody());
+  if (B.Overflow || Functions.size() > UINT16_MAX ||
+      Natives.size() > UINT16_MAX) {
+    fprintf(stderr, "Error: %s is too large for the VM\n",
+            F.getName().c_str());
+    return false;
+  }
+  return true;
+}
+
+// registers of every active frame, a call overflowing it is an error
+static const size_t StackSize = 1 << 22;
+static std::unique_ptr<double[]> Stack;
+static double *StackEnd;
+
+static SourceLocation locationOf(const BytecodeFunction &F, const Instr *I) {
+  SourceLocation Loc;
+  Loc.Line = F.Lines[I - F.Code.data()];
+  return Loc;
+}
+
+static double execute(const BytecodeFunction &F, double *R);
+
+// the function bench(f, n) times while the runtime calls it, and where its
+// frame goes
+static const BytecodeFunction *BenchTarget;
+static double *BenchFrame;
+static double benchTrampoline() { return execute(*BenchTarget, BenchFrame); }
+
+static double execute(const BytecodeFunction &F, double *R) {
+  const Instr *Code = F.Code.data();
+  const Instr *Ip = Code;
+  const Instr *I;
+  const double *K = Constants.data();
+
+#ifdef VM_COMPUTED_GOTO
+  static void *const Labels[] = {
+#define VM_LABEL(Name) &&do_##Name,
+      VM_OPCODES(VM_LABEL)
+#undef VM_LABEL
+  };
+#define VM_CASE(Name) do_##Name:
+#define VM_NEXT()                                                              \
+  do {                                                                         \
+    I = Ip++;                                                                  \
+    goto *Labels[I->Op];                                                       \
+  } while (0)
+  VM_NEXT();
+#else
+#define VM_CASE(Name) case Name:
+#define VM_NEXT() continue
+  while (true) {
+    I = Ip++;
+    switch (I->Op) {
+#endif
+
+  VM_CASE(LoadK) {
+    R[I->A] = K[I->B];
+    VM_NEXT();
+  }
+  VM_CASE(Mov) {
+    R[I->A] = R[I->B];
+    VM_NEXT();
+  }
+  VM_CASE(Add) {
+    R[I->A] = R[I->B] + R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Sub) {
+    R[I->A] = R[I->B] - R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Mul) {
+    R[I->A] = R[I->B] * R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Div) {
+    R[I->A] = R[I->B] / R[I->C];
+    VM_NEXT();
+  }
+  VM_CASE(Lt) {
+    R[I->A] = !(R[I->B] >= R[I->C]);
+    VM_NEXT();
+  }
+  VM_CASE(Jmp) {
+    Ip = Code + I->B;
+    VM_NEXT();
+  }
+  VM_CASE(JmpF) {
+    if (!isTrue(R[I->A]))
+      Ip = Code + I->B;
+    VM_NEXT();
+  }
+  VM_CASE(JmpT) {
+    if (isTrue(R[I->A]))
+      Ip = Code + I->B;
+    VM_NEXT();
+  }
+  VM_CASE(JmpGE) {
+    if (R[I->A] >= R[I->B])
+      Ip = Code + I->C;
+    VM_NEXT();
+  }
+  VM_CASE(Call) {
+    const BytecodeFunction &Callee = *Functions[I->B];
+    double *Frame = R + I->C;
+    if (Callee.NumRegs > size_t(StackEnd - Frame))
+      RuntimeError("Stack overflow", locationOf(F, I));
+    R[I->A] = execute(Callee, Frame);
+    VM_NEXT();
+  }
+  VM_CASE(CallN) {
+    const NativeFunction &Callee = Natives[I->B];
+    if (Callee.Def >= 0) {
+      const BytecodeFunction &Def = *Functions[Callee.Def];
+      double *Frame = R + I->C;
+      if (Def.NumRegs > size_t(StackEnd - Frame))
+        RuntimeError("Stack overflow", locationOf(F, I));
+      R[I->A] = execute(Def, Frame);
+      VM_NEXT();
+    }
+    if (!Callee.Fn)
+      RuntimeError("Unresolved extern", locationOf(F, I));
+    R[I->A] =
+        callNative(Callee.Fn, R + I->C, Callee.NumArgs, locationOf(F, I));
+    VM_NEXT();
+  }
+  VM_CASE(Ret) { return R[I->A]; }
+  VM_CASE(NewArr) {
+    R[I->A] = kdarray_handle(kdarray_new(R[I->B]));
+    VM_NEXT();
+  }
+  VM_CASE(MapFile) {
+    R[I->A] = kdarray_handle(
+        kdarray_map(reinterpret_cast<const char *>(kdarray_pointer(R[I->B]))));
+    VM_NEXT();
+  }
+  VM_CASE(Len) {
+    R[I->A] = double(uint64_t(kdarray_length(kdarray_pointer(R[I->B]))));
+    VM_NEXT();
+  }
+  VM_CASE(LoadE) {
+    R[I->A] = *kdarray_element(R[I->B], R[I->C], F.Lines[I - Code]);
+    VM_NEXT();
+  }
+  VM_CASE(StoreE) {
+    *kdarray_element(R[I->B], R[I->C], F.Lines[I - Code]) = R[I->A];
+    VM_NEXT();
+  }
+  VM_CASE(Bench) {
+    const BytecodeFunction *OldTarget = BenchTarget;
+    double *OldFrame = BenchFrame;
+    BenchTarget = Functions[I->B].get();
+    BenchFrame = R + F.NumRegs;
+    if (BenchTarget->NumRegs > size_t(StackEnd - BenchFrame))
+      RuntimeError("Stack overflow", locationOf(F, I));
+    R[I->A] = kdbench(benchTrampoline, R[I->C]);
+    BenchTarget = OldTarget;
+    BenchFrame = OldFrame;
+    VM_NEXT();
+  }
+  VM_CASE(BenchN) {
+    const NativeFunction &Timed = Natives[I->B];
+    if (Timed.Def >= 0) {
+      const BytecodeFunction *OldTarget = BenchTarget;
+      double *OldFrame = BenchFrame;
+      BenchTarget = Functions[Timed.Def].get();
+      BenchFrame = R + F.NumRegs;
+      if (BenchTarget->NumRegs > size_t(StackEnd - BenchFrame))
+        RuntimeError("Stack overflow", locationOf(F, I));
+      R[I->A] = kdbench(benchTrampoline, R[I->C]);
+      BenchTarget = OldTarget;
+      BenchFrame = OldFrame;
+      VM_NEXT();
+    }
+    if (!Timed.Fn)
+      RuntimeError("Unresolved extern", locationOf(F, I));
+    R[I->A] = kdbench(reinterpret_cast<double (*)()>(Timed.Fn), R[I->C]);
+    VM_NEXT();
+  }
+
+#ifndef VM_COMPUTED_GOTO
+    }
+  }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+void VMAddDefinition(std::unique_ptr<FunctionAST> F) {
+  PrototypeAST &P = F->getProto();
+  if (P.isBinaryOp())
+    BinopPrecedence[P.getOperatorName()] = P.getBianryPrecedence();
+
+  // registered before compiling the body so the function can call itself,
+  // callers compiled earlier keep calling a previous definition
+  const Symbol *Previous = lookupSymbol(P.getName());
+  Symbol Old = Previous ? *Previous : Symbol();
+  unsigned Index = Functions.size();
+  Functions.push_back(std::make_unique<BytecodeFunction>());
+  Symbols[P.getName()] = {false, Index, unsigned(P.getArgs().size())};
+
+  if (compileFunction(*F, *Functions.back(), Index)) {
+    // a forward declared extern now names this function, as it does in the
+    // interpreter, instead of a native symbol of the same name
+    if (Previous && Old.IsNative && Old.NumArgs == P.getArgs().size() &&
+        Natives[Old.Index].Def < 0)
+      Natives[Old.Index].Def = Index;
+    Definitions.push_back(std::move(F));
+    return;
+  }
+
+  Functions.pop_back();
+  if (Previous)
+    Symbols[P.getName()] = Old;
+  else
+    Symbols.erase(P.getName());
+  if (P.isBinaryOp())
+    BinopPrecedence.erase(P.getOperatorName());
+}
+
+void VMAddExtern(std::unique_ptr<PrototypeAST> P) {
+  // an extern doesn't replace a definition of the same name, as in codegen,
+  // and declaring one again keeps its slot so a later definition binds all
+  // of its callers
+  const Symbol *Previous = lookupSymbol(P->getName());
+  unsigned NumArgs = P->getArgs().size();
+  if (Previous && (!Previous->IsNative || Previous->NumArgs == NumArgs))
+    return;
+  Symbols[P->getName()] = {true, unsigned(Natives.size()), NumArgs};
+  Natives.push_back({findNative(P->getName()), NumArgs});
+}
+
+void VMRunTopLevelExpr(FunctionAST &F) {
+  BytecodeFunction Fn;
+  if (!compileFunction(F, Fn, UINT_MAX))
+    return;
+  if (!Stack) {
+    Stack.reset(new double[StackSize]);
+    StackEnd = Stack.get() + StackSize;
+  }
+  if (Fn.NumRegs > StackSize)
+    RuntimeError("Stack overflow", SourceLocation());
+  execute(Fn, Stack.get());
+}